@@ -0,0 +1,854 @@
+#include "ascii_lib.hpp"
+#include "cmdline.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Microbenchmarks of the ascii_lib kernels on synthetic and photo inputs. Every kernel is timed in batches long
+// enough for the clock, over several repetitions after a warmup, and reported per output cell. With --baseline the
+// results are compared against a stored run, and any regression beyond its tolerances fails the run. Only bytes and
+// allocations per frame are compared by default, timings only with --timing against a run from the same machine.
+
+namespace {
+
+// Heap allocations so far, counted by the replaced operator new
+std::atomic<std::size_t> allocations{0};
+
+} // namespace
+
+// None of these are inlined, GCC would otherwise pair malloc() in operator new with free() at every delete
+[[gnu::noinline]] void* operator new(const std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int SOURCE_WIDTH = 1920; // Synthetic inputs, the photo keeps its own size
+constexpr int SOURCE_HEIGHT = 1080;
+constexpr std::array OUTPUT_WIDTHS = {80, 200, 600};
+constexpr int ALLOCATION_CALLS = 4; // Untimed calls allocations are averaged over
+
+struct Settings {
+    int repetitions = 10;
+    std::chrono::milliseconds batch{20}; // Shortest timed batch
+    std::chrono::milliseconds warmup{50};
+    std::string_view filter;
+};
+
+struct Result {
+    std::string name;
+    std::string input;
+    int width;
+    int height;
+    double ns_per_cell;
+    double rsd; // Relative standard deviation of the repetitions, percent
+    double min_ns_per_cell;
+    double bytes_per_frame; // Negative when the kernel writes no output bytes
+    double allocations_per_frame;
+    double table_bytes = -1; // Of the lookup table the kernel reads, negative without one
+};
+
+// Allowed growth over the baseline: relative for ns/cell (compared on the fastest repetition) and bytes/frame,
+// absolute for allocations/frame. The ns/cell tolerance widens to three standard deviations of the two runs.
+struct Tolerances {
+    double ns_per_cell = 0.20;
+    double bytes_per_frame = 0.0;
+    double allocations_per_frame = 0.0;
+};
+
+struct Baseline {
+    Tolerances tolerances;
+    std::vector<Result> results;
+};
+
+// Packed RGB24 image
+struct Image {
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> rgb;
+};
+
+// YUV420P planes with an AVFrame pointing at them
+struct YuvImage {
+    std::vector<unsigned char> y;
+    std::vector<unsigned char> u;
+    std::vector<unsigned char> v;
+    AVFrame frame{};
+};
+
+// Keeps results observable so that the timed calls are not optimized away
+volatile std::size_t sink = 0;
+
+Image gradient_image() {
+    Image image{.width = SOURCE_WIDTH, .height = SOURCE_HEIGHT, .rgb = {}};
+    image.rgb.resize(static_cast<std::size_t>(image.width) * image.height * 3);
+    for (int y = 0; y < image.height; ++y) {
+        for (int x = 0; x < image.width; ++x) {
+            unsigned char* pixel = &image.rgb[(static_cast<std::size_t>(y) * image.width + x) * 3];
+            pixel[0] = static_cast<unsigned char>(x * 255 / (image.width - 1));
+            pixel[1] = static_cast<unsigned char>(y * 255 / (image.height - 1));
+            pixel[2] = static_cast<unsigned char>((x + y) * 255 / (image.width + image.height - 2));
+        }
+    }
+    return image;
+}
+
+Image noise_image() {
+    Image image{.width = SOURCE_WIDTH, .height = SOURCE_HEIGHT, .rgb = {}};
+    image.rgb.resize(static_cast<std::size_t>(image.width) * image.height * 3);
+    std::mt19937 rng(1);
+    for (unsigned char& byte : image.rgb) {
+        byte = static_cast<unsigned char>(rng());
+    }
+    return image;
+}
+
+std::optional<Image> photo_image(const std::filesystem::path& path) {
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 3);
+    if (data == nullptr) {
+        return std::nullopt;
+    }
+    Image image{.width = width, .height = height, .rgb = {}};
+    image.rgb.assign(data, data + static_cast<std::size_t>(width) * height * 3);
+    stbi_image_free(data);
+    return image;
+}
+
+Image resize_image(const Image& source, const int width, const int height) {
+    Image image{.width = width, .height = height, .rgb = {}};
+    image.rgb.resize(static_cast<std::size_t>(width) * height * 3);
+    stbir_resize_uint8_linear(source.rgb.data(), source.width, source.height, 0, image.rgb.data(), width, height, 0,
+                              STBIR_RGB);
+    return image;
+}
+
+// BT.601 limited range, chroma averaged over 2x2 blocks
+void to_yuv420(const Image& image, YuvImage& out) {
+    const int chromaW = (image.width + 1) / 2;
+    const int chromaH = (image.height + 1) / 2;
+    out.y.resize(static_cast<std::size_t>(image.width) * image.height);
+    out.u.assign(static_cast<std::size_t>(chromaW) * chromaH, 0);
+    out.v.assign(out.u.size(), 0);
+    std::vector<int> uSums(out.u.size());
+    std::vector<int> vSums(out.u.size());
+    std::vector<int> counts(out.u.size());
+
+    for (int y = 0; y < image.height; ++y) {
+        for (int x = 0; x < image.width; ++x) {
+            const unsigned char* pixel = &image.rgb[(static_cast<std::size_t>(y) * image.width + x) * 3];
+            const int r = pixel[0];
+            const int g = pixel[1];
+            const int b = pixel[2];
+            out.y[static_cast<std::size_t>(y) * image.width + x] =
+                static_cast<unsigned char>(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+            const std::size_t c = static_cast<std::size_t>(y / 2) * chromaW + x / 2;
+            uSums[c] += 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+            vSums[c] += 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+            ++counts[c];
+        }
+    }
+    for (std::size_t c = 0; c < out.u.size(); ++c) {
+        out.u[c] = static_cast<unsigned char>(uSums[c] / counts[c]);
+        out.v[c] = static_cast<unsigned char>(vSums[c] / counts[c]);
+    }
+
+    out.frame = AVFrame{};
+    out.frame.format = AV_PIX_FMT_YUV420P;
+    out.frame.width = image.width;
+    out.frame.height = image.height;
+    out.frame.color_range = AVCOL_RANGE_MPEG;
+    out.frame.colorspace = AVCOL_SPC_BT470BG;
+    out.frame.data[0] = out.y.data();
+    out.frame.data[1] = out.u.data();
+    out.frame.data[2] = out.v.data();
+    out.frame.linesize[0] = image.width;
+    out.frame.linesize[1] = chromaW;
+    out.frame.linesize[2] = chromaW;
+}
+
+std::string_view simd_level_name(const AsciiArt::SimdLevel level) {
+    switch (level) {
+    case AsciiArt::SimdLevel::Scalar:
+        return "scalar";
+    case AsciiArt::SimdLevel::SSE41:
+        return "sse41";
+    case AsciiArt::SimdLevel::AVX2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+std::vector<AsciiArt::SimdLevel> supported_levels() {
+    std::vector<AsciiArt::SimdLevel> levels = {AsciiArt::SimdLevel::Scalar};
+    const AsciiArt::SimdLevel detected = AsciiArt::detect_simd_level();
+    if (detected == AsciiArt::SimdLevel::SSE41 || detected == AsciiArt::SimdLevel::AVX2) {
+        levels.push_back(AsciiArt::SimdLevel::SSE41);
+    }
+    if (detected == AsciiArt::SimdLevel::AVX2) {
+        levels.push_back(AsciiArt::SimdLevel::AVX2);
+    }
+    return levels;
+}
+
+// Runs `fn` in batches of a calibrated number of calls and returns the nanoseconds per call of every repetition
+template <typename F>
+std::vector<double> time_calls(const Settings& settings, F&& fn) {
+    const Clock::time_point warmup_end = Clock::now() + settings.warmup;
+    std::size_t iterations = 1;
+    while (Clock::now() < warmup_end) {
+        fn();
+    }
+
+    // Double the batch until it is long enough to time reliably
+    while (true) {
+        const Clock::time_point start = Clock::now();
+        for (std::size_t i = 0; i < iterations; ++i) {
+            fn();
+        }
+        if (Clock::now() - start >= settings.batch) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    std::vector<double> samples;
+    for (int repetition = 0; repetition < settings.repetitions; ++repetition) {
+        const Clock::time_point start = Clock::now();
+        for (std::size_t i = 0; i < iterations; ++i) {
+            fn();
+        }
+        const std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+        samples.push_back(elapsed.count() / static_cast<double>(iterations));
+    }
+    return samples;
+}
+
+// Bytes in KiB or MiB, to compare table sizes with the caches
+std::string format_size(const double bytes) {
+    return bytes >= 1024 * 1024 ? std::format("{:.0f} MiB", bytes / (1024 * 1024))
+                                : std::format("{:.0f} KiB", bytes / 1024);
+}
+
+class Runner {
+public:
+    explicit Runner(const Settings& settings) : settings_(settings) {}
+
+    // Times `fn`, which converts or encodes `cells` cells per call and returns the bytes it wrote, if any
+    template <typename F>
+    void run(const std::string_view name, const std::string_view input, const int width, const int height, F&& fn) {
+        measure(name, input, width, height, false, -1, fn);
+    }
+
+    // Same for a kernel reading `lut`, whose size is reported next to the timings
+    template <typename F>
+    void run_lut(const std::string_view name, const std::string_view input, const int width, const int height,
+                 const AsciiArt::ColorLut& lut, F&& fn) {
+        measure(name, input, width, height, false, static_cast<double>(lut.size_bytes()), fn);
+    }
+
+    // Same with stdout sent to /dev/null while timing, for kernels that print
+    template <typename F>
+    void run_to_null(const std::string_view name, const std::string_view input, const int width, const int height,
+                     F&& fn) {
+        measure(name, input, width, height, true, -1, fn);
+    }
+
+    [[nodiscard]] const std::vector<Result>& results() const {
+        return results_;
+    }
+
+    static void print_header() {
+        std::cout << std::format("{:<24}{:<10}{:>10}{:>10}{:>8}{:>10}{:>12}{:>8}{:>10}", "Benchmark", "Input",
+                                 "Cells", "ns/cell", "+-%", "Mcells/s", "Bytes/frame", "Allocs", "Table")
+                  << '\n';
+    }
+
+private:
+    template <typename F>
+    void measure(const std::string_view name, const std::string_view input, const int width, const int height,
+                 const bool to_null, const double table_bytes, F& fn) {
+        if (!settings_.filter.empty() && name.find(settings_.filter) == std::string_view::npos) {
+            return;
+        }
+
+        int stdout_fd = -1;
+        if (to_null) {
+            std::cout.flush();
+            stdout_fd = ::dup(STDOUT_FILENO);
+            const int null_fd = ::open("/dev/null", O_WRONLY);
+            ::dup2(null_fd, STDOUT_FILENO);
+            ::close(null_fd);
+        }
+        double bytes = -1;
+        const auto call = [&] {
+            const std::ptrdiff_t written = fn();
+            bytes = static_cast<double>(written);
+            sink = sink + static_cast<std::size_t>(written);
+        };
+        const std::vector<double> samples = time_calls(settings_, call);
+        const std::size_t allocations_before = allocations.load(std::memory_order_relaxed);
+        for (int i = 0; i < ALLOCATION_CALLS; ++i) {
+            call();
+        }
+        const std::size_t allocated = allocations.load(std::memory_order_relaxed) - allocations_before;
+        if (to_null) {
+            std::cout.flush();
+            ::dup2(stdout_fd, STDOUT_FILENO);
+            ::close(stdout_fd);
+        }
+
+        const auto cells = static_cast<double>(width) * height;
+        double mean = 0;
+        for (const double sample : samples) {
+            mean += sample;
+        }
+        mean /= static_cast<double>(samples.size());
+        double variance = 0;
+        for (const double sample : samples) {
+            variance += (sample - mean) * (sample - mean);
+        }
+        variance /= static_cast<double>(samples.size());
+
+        Result result{.name = std::string(name),
+                      .input = std::string(input),
+                      .width = width,
+                      .height = height,
+                      .ns_per_cell = mean / cells,
+                      .rsd = mean > 0 ? 100.0 * std::sqrt(variance) / mean : 0.0,
+                      .min_ns_per_cell = *std::min_element(samples.begin(), samples.end()) / cells,
+                      .bytes_per_frame = bytes,
+                      .allocations_per_frame = static_cast<double>(allocated) / ALLOCATION_CALLS,
+                      .table_bytes = table_bytes};
+        print(result);
+        results_.push_back(std::move(result));
+    }
+
+    static void print(const Result& result) {
+        const std::string bytes = result.bytes_per_frame >= 0 ? std::format("{:.0f}", result.bytes_per_frame) : "-";
+        const std::string table = result.table_bytes >= 0 ? format_size(result.table_bytes) : "-";
+        std::cout << std::format("{:<24}{:<10}{:>10}{:>10.3f}{:>8.1f}{:>10.1f}{:>12}{:>8.4g}{:>10}", result.name,
+                                 result.input, std::format("{}x{}", result.width, result.height), result.ns_per_cell,
+                                 result.rsd, 1e3 / result.ns_per_cell, bytes, result.allocations_per_frame, table)
+                  << std::endl;
+    }
+
+    const Settings& settings_;
+    std::vector<Result> results_;
+};
+
+// Cross-checks a kernel against the scalar reference, benchmarks of a wrong kernel mean nothing
+bool check_cells(const std::string_view name, const AsciiArt::CellFrame& expected, const AsciiArt::CellFrame& actual) {
+    if (expected == actual) {
+        return true;
+    }
+    std::cerr << "Mismatch against the scalar kernel: " << name << '\n';
+    return false;
+}
+
+bool check_accumulate(const AsciiArt::SimdLevel level) {
+    std::mt19937 rng(2);
+    std::vector<unsigned char> row(SOURCE_WIDTH * 3 + 7);
+    for (unsigned char& byte : row) {
+        byte = static_cast<unsigned char>(rng());
+    }
+    std::vector<std::uint16_t> expected(row.size());
+    std::vector<std::uint16_t> actual(row.size());
+    for (int i = 0; i < 200; ++i) {
+        AsciiArt::accumulate_row_scalar(row.data(), static_cast<int>(row.size()), expected.data());
+        AsciiArt::accumulate_row_kernel(level)(row.data(), static_cast<int>(row.size()), actual.data());
+    }
+    if (expected == actual) {
+        return true;
+    }
+    std::cerr << "Mismatch against the scalar kernel: accumulate_row/" << simd_level_name(level) << '\n';
+    return false;
+}
+
+// Converts every benchmark input, returns false when a kernel disagrees with the scalar reference
+bool run_input(Runner& runner, const std::string_view input, const Image& source, utils::WorkerPool& pool) {
+    const std::vector<AsciiArt::SimdLevel> levels = supported_levels();
+    bool ok = true;
+
+    YuvImage sourceYuv;
+    to_yuv420(source, sourceYuv);
+
+    std::vector<AsciiArt::ColorLut> luts;
+    for (int bits = AsciiArt::ColorLut::MIN_BITS; bits <= AsciiArt::ColorLut::MAX_BITS; ++bits) {
+        luts.emplace_back(bits);
+    }
+
+    for (const int width : OUTPUT_WIDTHS) {
+        const double aspectRatio = static_cast<double>(source.height) / source.width;
+        const int height = std::max(1, static_cast<int>(width * aspectRatio * 0.45));
+        const Image scaled = resize_image(source, width, height);
+        YuvImage scaledYuv;
+        to_yuv420(scaled, scaledYuv);
+
+        AsciiArt::CellFrame cells(width, height);
+        AsciiArt::CellFrame reference(width, height);
+        const auto rgb_rows = [&](const AsciiArt::RgbRowKernel kernel) {
+            for (int y = 0; y < height; ++y) {
+                const std::size_t offset = static_cast<std::size_t>(y) * width;
+                kernel(&scaled.rgb[offset * 3], width, &cells.glyphs[offset], &cells.colors[offset]);
+            }
+            return std::ptrdiff_t{-1};
+        };
+
+        for (int y = 0; y < height; ++y) {
+            const std::size_t offset = static_cast<std::size_t>(y) * width;
+            AsciiArt::rgb_row_kernel(AsciiArt::SimdLevel::Scalar)(&scaled.rgb[offset * 3], width,
+                                                                  &reference.glyphs[offset], &reference.colors[offset]);
+        }
+
+        runner.run("pixel_to_ascii", input, width, height, [&] {
+            for (std::size_t i = 0; i < cells.size(); ++i) {
+                const AsciiArt::ColoredPixel cell =
+                    AsciiArt::pixel_to_ascii(scaled.rgb[i * 3], scaled.rgb[i * 3 + 1], scaled.rgb[i * 3 + 2]);
+                cells.glyphs[i] = cell.ascii;
+                cells.colors[i] = static_cast<unsigned char>(cell.colorIndex);
+            }
+            return std::ptrdiff_t{-1};
+        });
+
+        for (const AsciiArt::SimdLevel level : levels) {
+            const std::string name = std::format("rgb_row/{}", simd_level_name(level));
+            const AsciiArt::RgbRowKernel kernel = AsciiArt::rgb_row_kernel(level);
+            rgb_rows(kernel);
+            ok = check_cells(name, reference, cells) && ok;
+            runner.run(name, input, width, height, [&] { return rgb_rows(kernel); });
+        }
+
+        // Table lookups against the arithmetic kernels above, from a table that fits L1 up to one far past L2
+        for (const AsciiArt::ColorLut& lut : luts) {
+            runner.run_lut(std::format("rgb_row/lut{}", lut.bits()), input, width, height, lut, [&] {
+                for (int y = 0; y < height; ++y) {
+                    const std::size_t offset = static_cast<std::size_t>(y) * width;
+                    AsciiArt::rgb_row_to_ascii_lut(lut, &scaled.rgb[offset * 3], width, &cells.glyphs[offset],
+                                                   &cells.colors[offset]);
+                }
+                return std::ptrdiff_t{-1};
+            });
+        }
+
+        AsciiArt::Converter converter(width, height);
+        runner.run("yuv_row", input, width, height, [&] {
+            return converter.convert(scaledYuv.frame, cells) ? std::ptrdiff_t{-1} : std::ptrdiff_t{0};
+        });
+
+        AVFrame rgbFrame{};
+        rgbFrame.format = AV_PIX_FMT_RGB24;
+        rgbFrame.width = width;
+        rgbFrame.height = height;
+        rgbFrame.data[0] = const_cast<unsigned char*>(scaled.rgb.data());
+        rgbFrame.linesize[0] = width * 3;
+        runner.run("frame_to_ascii", input, width, height, [&] {
+            AsciiArt::frame_to_ascii(&rgbFrame, width, height, 3, cells);
+            return std::ptrdiff_t{-1};
+        });
+
+        // From the source size, resampling included
+        runner.run("image_to_ascii", input, width, height, [&] {
+            const AsciiArt::CellFrame result =
+                AsciiArt::image_to_ascii(source.rgb.data(), source.width, source.height, 3, width, height);
+            sink = sink + static_cast<unsigned char>(result.glyphs[0]);
+            return std::ptrdiff_t{-1};
+        });
+        if (pool.size() > 1) {
+            runner.run(std::format("image_to_ascii/{}t", pool.size()), input, width, height, [&] {
+                const AsciiArt::CellFrame result = AsciiArt::image_to_ascii(
+                    source.rgb.data(), source.width, source.height, 3, width, height, nullptr, &pool);
+                sink = sink + static_cast<unsigned char>(result.glyphs[0]);
+                return std::ptrdiff_t{-1};
+            });
+        }
+        runner.run("convert_area", input, width, height, [&] {
+            return converter.convert_area(sourceYuv.frame, false, cells) ? std::ptrdiff_t{-1} : std::ptrdiff_t{0};
+        });
+        runner.run("convert_area/mono", input, width, height, [&] {
+            return converter.convert_area(sourceYuv.frame, true, cells) ? std::ptrdiff_t{-1} : std::ptrdiff_t{0};
+        });
+
+        // Encoders on the area converted frame, the diff against it with every tenth cell changed
+        (void)converter.convert_area(sourceYuv.frame, false, cells);
+        AsciiArt::CellFrame changed = cells;
+        for (std::size_t i = 0; i < changed.size(); i += 10) {
+            changed.glyphs[i] = AsciiArt::ASCII_CHARS[i % AsciiArt::ASCII_CHARS.size()];
+            changed.colors[i] = static_cast<unsigned char>(16 + i % 216);
+        }
+        AsciiArt::ByteBuffer buffer;
+        runner.run("encode_frame", input, width, height, [&] {
+            buffer.clear();
+            AsciiArt::encode_ascii_frame(cells, buffer);
+            return static_cast<std::ptrdiff_t>(buffer.size());
+        });
+        runner.run("encode_diff", input, width, height, [&] {
+            buffer.clear();
+            AsciiArt::encode_ascii_diff(cells, changed, buffer);
+            return static_cast<std::ptrdiff_t>(buffer.size());
+        });
+
+        runner.run_to_null("print_ascii_frame", input, width, height, [&] {
+            AsciiArt::print_ascii_frame(cells);
+            return std::ptrdiff_t{-1};
+        });
+    }
+    return ok;
+}
+
+// Writes the results in the baseline format, one result per line
+bool write_json(const std::filesystem::path& path, const std::vector<Result>& results, const Tolerances& tolerances) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    out << std::format("{{\n  \"tolerances\": {{\"ns_per_cell\": {}, \"bytes_per_frame\": {}, "
+                       "\"allocations_per_frame\": {}}},\n",
+                       tolerances.ns_per_cell, tolerances.bytes_per_frame, tolerances.allocations_per_frame);
+    out << "  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result& result = results[i];
+        out << std::format("    {{\"name\": \"{}\", \"input\": \"{}\", \"width\": {}, \"height\": {}, "
+                           "\"ns_per_cell\": {:.4f}, \"rsd\": {:.2f}, \"min_ns_per_cell\": {:.4f}",
+                           result.name, result.input, result.width, result.height, result.ns_per_cell, result.rsd,
+                           result.min_ns_per_cell);
+        if (result.bytes_per_frame >= 0) {
+            out << std::format(", \"bytes_per_frame\": {:.0f}", result.bytes_per_frame);
+        }
+        out << std::format(", \"allocations_per_frame\": {}", result.allocations_per_frame);
+        if (result.table_bytes >= 0) {
+            out << std::format(", \"table_bytes\": {:.0f}", result.table_bytes);
+        }
+        out << (i + 1 < results.size() ? "},\n" : "}\n");
+    }
+    out << "  ]\n}\n";
+    return static_cast<bool>(out);
+}
+
+// Value of `"key": ` on a line written by write_json, which never nests the keys read here
+std::optional<std::string_view> json_value(const std::string_view line, const std::string_view key) {
+    const std::string quoted = std::format("\"{}\": ", key);
+    const std::size_t start = line.find(quoted);
+    if (start == std::string_view::npos) {
+        return std::nullopt;
+    }
+    const std::string_view value = line.substr(start + quoted.size());
+    if (value.starts_with('"')) {
+        return value.substr(1, value.find('"', 1) - 1);
+    }
+    return value.substr(0, value.find_first_of(",}"));
+}
+
+std::optional<double> json_number(const std::string_view line, const std::string_view key) {
+    const std::optional<std::string_view> value = json_value(line, key);
+    double number = 0;
+    if (!value || std::from_chars(value->data(), value->data() + value->size(), number).ec != std::errc()) {
+        return std::nullopt;
+    }
+    return number;
+}
+
+std::optional<Baseline> read_baseline(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    if (!in) {
+        return std::nullopt;
+    }
+    Baseline baseline;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("\"tolerances\"") != std::string::npos) {
+            Tolerances& tolerances = baseline.tolerances;
+            tolerances.ns_per_cell = json_number(line, "ns_per_cell").value_or(tolerances.ns_per_cell);
+            tolerances.bytes_per_frame = json_number(line, "bytes_per_frame").value_or(tolerances.bytes_per_frame);
+            tolerances.allocations_per_frame =
+                json_number(line, "allocations_per_frame").value_or(tolerances.allocations_per_frame);
+            continue;
+        }
+        const std::optional<std::string_view> name = json_value(line, "name");
+        const std::optional<std::string_view> input = json_value(line, "input");
+        const std::optional<double> width = json_number(line, "width");
+        const std::optional<double> height = json_number(line, "height");
+        const std::optional<double> ns_per_cell = json_number(line, "min_ns_per_cell");
+        if (!name || !input || !width || !height || !ns_per_cell) {
+            continue;
+        }
+        baseline.results.push_back({.name = std::string(*name),
+                                    .input = std::string(*input),
+                                    .width = static_cast<int>(*width),
+                                    .height = static_cast<int>(*height),
+                                    .ns_per_cell = json_number(line, "ns_per_cell").value_or(*ns_per_cell),
+                                    .rsd = json_number(line, "rsd").value_or(0),
+                                    .min_ns_per_cell = *ns_per_cell,
+                                    .bytes_per_frame = json_number(line, "bytes_per_frame").value_or(-1),
+                                    .allocations_per_frame = json_number(line, "allocations_per_frame").value_or(0),
+                                    .table_bytes = json_number(line, "table_bytes").value_or(-1)});
+    }
+    return baseline;
+}
+
+// Prints every metric outside its tolerance, returns false if any got worse. Timings are only compared with `timing`.
+// Baseline entries that this run leaves out on purpose may be missing, any other missing entry fails the run
+bool compare_with_baseline(const Baseline& baseline, const std::vector<Result>& results, const bool timing,
+                           const std::function<bool(const Result&)>& left_out) {
+    const Tolerances& tolerances = baseline.tolerances;
+    std::size_t compared = 0;
+    std::size_t regressions = 0;
+    std::size_t missing = 0;
+    std::vector<std::string> lines;
+
+    const auto add_line = [&](const Result& result, const std::string_view metric, const double before,
+                              const double after, const std::string_view verdict) {
+        const double change = before > 0 ? 100.0 * (after - before) / before : 0.0;
+        lines.push_back(std::format("{:<24}{:<10}{:>10}  {:<18}{:>12.4g}{:>12.4g}{:>+9.1f}%  {}", result.name,
+                                    result.input, std::format("{}x{}", result.width, result.height), metric, before,
+                                    after, change, verdict));
+    };
+
+    const auto same = [](const Result& a, const Result& b) {
+        return a.name == b.name && a.input == b.input && a.width == b.width && a.height == b.height;
+    };
+
+    for (const Result& result : results) {
+        const auto match = std::find_if(baseline.results.begin(), baseline.results.end(),
+                                        [&](const Result& base) { return same(base, result); });
+        if (match == baseline.results.end()) {
+            continue; // New benchmark, or one that depends on the machine like the pool size
+        }
+        ++compared;
+
+        if (timing) {
+            const double tolerance = std::max(tolerances.ns_per_cell, 3 * std::hypot(match->rsd, result.rsd) / 100);
+            if (result.min_ns_per_cell > match->min_ns_per_cell * (1 + tolerance)) {
+                add_line(result, "ns/cell (min)", match->min_ns_per_cell, result.min_ns_per_cell, "REGRESSED");
+                ++regressions;
+            } else if (result.min_ns_per_cell < match->min_ns_per_cell * (1 - tolerance)) {
+                add_line(result, "ns/cell (min)", match->min_ns_per_cell, result.min_ns_per_cell, "improved");
+            }
+        }
+        if (match->bytes_per_frame >= 0 && result.bytes_per_frame >= 0) {
+            if (result.bytes_per_frame > match->bytes_per_frame * (1 + tolerances.bytes_per_frame)) {
+                add_line(result, "bytes/frame", match->bytes_per_frame, result.bytes_per_frame, "REGRESSED");
+                ++regressions;
+            } else if (result.bytes_per_frame < match->bytes_per_frame * (1 - tolerances.bytes_per_frame)) {
+                add_line(result, "bytes/frame", match->bytes_per_frame, result.bytes_per_frame, "improved");
+            }
+        }
+        if (match->table_bytes >= 0 && result.table_bytes > match->table_bytes) {
+            add_line(result, "table bytes", match->table_bytes, result.table_bytes, "REGRESSED");
+            ++regressions;
+        } else if (result.table_bytes >= 0 && result.table_bytes < match->table_bytes) {
+            add_line(result, "table bytes", match->table_bytes, result.table_bytes, "improved");
+        }
+        if (result.allocations_per_frame > match->allocations_per_frame + tolerances.allocations_per_frame) {
+            add_line(result, "allocations/frame", match->allocations_per_frame, result.allocations_per_frame,
+                     "REGRESSED");
+            ++regressions;
+        } else if (result.allocations_per_frame < match->allocations_per_frame - tolerances.allocations_per_frame) {
+            add_line(result, "allocations/frame", match->allocations_per_frame, result.allocations_per_frame,
+                     "improved");
+        }
+    }
+
+    for (const Result& base : baseline.results) {
+        if (left_out(base) ||
+            std::any_of(results.begin(), results.end(), [&](const Result& result) { return same(base, result); })) {
+            continue;
+        }
+        lines.push_back(std::format("{:<24}{:<10}{:>10}  missing from this run", base.name, base.input,
+                                    std::format("{}x{}", base.width, base.height)));
+        ++missing;
+    }
+
+    std::cout << '\n'
+              << std::format("Compared {} of {} benchmarks with the baseline, tolerances: {}bytes/frame {:.0f}%, "
+                             "allocations/frame {}",
+                             compared, results.size(),
+                             timing ? std::format("ns/cell {:.0f}% or 3 sd, ", 100 * tolerances.ns_per_cell)
+                                    : std::string("ns/cell not compared, "),
+                             100 * tolerances.bytes_per_frame, tolerances.allocations_per_frame)
+              << '\n';
+    if (!lines.empty()) {
+        std::cout << std::format("{:<24}{:<10}{:>10}  {:<18}{:>12}{:>12}{:>10}", "Benchmark", "Input", "Cells",
+                                 "Metric", "Baseline", "Current", "Change")
+                  << '\n';
+        for (const std::string& line : lines) {
+            std::cout << line << '\n';
+        }
+    }
+    if (regressions == 0 && missing == 0) {
+        std::cout << "No regressions" << '\n';
+    }
+    if (regressions > 0) {
+        std::cout << std::format("{} regression{}", regressions, regressions == 1 ? "" : "s") << '\n';
+    }
+    if (missing > 0) {
+        std::cout << std::format("{} baseline benchmark{} missing", missing, missing == 1 ? "" : "s") << '\n';
+    }
+    return regressions == 0 && missing == 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Settings settings;
+    std::filesystem::path photo_path = "examples/image.png";
+    bool custom_photo = false;
+    std::filesystem::path json_path;
+    std::filesystem::path baseline_path;
+    bool timing = false;
+
+    utils::cmd::add_option({.name = "repetitions",
+                            .description = "Set timed repetitions per benchmark",
+                            .value = "n",
+                            .default_value = 10});
+    utils::cmd::add_option({.name = "quick", .description = "Fewer and shorter repetitions"});
+    utils::cmd::add_option(
+        {.name = "filter", .description = "Only run benchmarks whose name contains this", .value = "text"});
+    utils::cmd::add_option({.name = "image",
+                            .description = "Set the photo input",
+                            .value = "file",
+                            .default_value = std::string_view("examples/image.png")});
+    utils::cmd::add_option({.name = "json", .description = "Also write the results to this file", .value = "file"});
+    utils::cmd::add_option({.name = "baseline",
+                            .description = "Compare with the results in this file and fail on regressions",
+                            .value = "file"});
+    utils::cmd::add_option({.name = "timing",
+                            .description = "Also fail on slower ns/cell, for a baseline recorded on this machine"});
+    utils::cmd::add_option({.alt = 'h', .name = "help", .description = "Show this help message"});
+
+    const auto program_name = utils::cmd::shift(argc, argv); // Skip program name
+
+    while (argc > 0) {
+        const std::string_view arg = utils::cmd::shift(argc, argv);
+
+        if (arg == "-h" || arg == "--help") {
+            utils::cmd::print_help(program_name);
+            return 0;
+        }
+        if (arg == "--repetitions") {
+            const auto repetitions_str = utils::cmd::shift(argc, argv);
+            int repetitions = 0;
+            if (std::from_chars(repetitions_str.data(), repetitions_str.data() + repetitions_str.size(), repetitions)
+                        .ec != std::errc() ||
+                repetitions < 1) {
+                std::cerr << "Invalid repetitions value: " << repetitions_str << '\n';
+                return 1;
+            }
+            settings.repetitions = repetitions;
+        } else if (arg == "--quick") {
+            settings.repetitions = 3;
+            settings.batch = std::chrono::milliseconds(5);
+            settings.warmup = std::chrono::milliseconds(10);
+        } else if (arg == "--filter") {
+            settings.filter = utils::cmd::shift(argc, argv);
+        } else if (arg == "--image") {
+            photo_path = static_cast<std::filesystem::path>(utils::cmd::shift(argc, argv));
+            custom_photo = true;
+        } else if (arg == "--json") {
+            json_path = static_cast<std::filesystem::path>(utils::cmd::shift(argc, argv));
+        } else if (arg == "--baseline") {
+            baseline_path = static_cast<std::filesystem::path>(utils::cmd::shift(argc, argv));
+        } else if (arg == "--timing") {
+            timing = true;
+        } else {
+            std::cerr << "Unknown argument: " << arg << '\n';
+            return 1;
+        }
+    }
+
+    // Read first, so that a bad path fails before the run
+    Baseline baseline;
+    if (!baseline_path.empty()) {
+        std::optional<Baseline> stored = read_baseline(baseline_path);
+        if (!stored) {
+            std::cerr << "Error reading the baseline " << baseline_path << '\n';
+            return 1;
+        }
+        baseline = std::move(*stored);
+    }
+
+    utils::WorkerPool pool(std::max(1U, std::thread::hardware_concurrency()));
+    Runner runner(settings);
+    bool ok = true;
+
+    std::cout << std::format("SIMD level: {}, {} threads", simd_level_name(AsciiArt::detect_simd_level()),
+                             pool.size())
+              << '\n';
+    for (const AsciiArt::SimdLevel level : supported_levels()) {
+        ok = check_accumulate(level) && ok;
+    }
+    Runner::print_header();
+
+    ok = run_input(runner, "gradient", gradient_image(), pool) && ok;
+    ok = run_input(runner, "noise", noise_image(), pool) && ok;
+    if (const std::optional<Image> photo = photo_image(photo_path)) {
+        ok = run_input(runner, "photo", *photo, pool) && ok;
+    } else {
+        std::cerr << "Skipping the photo input, could not load " << photo_path << '\n';
+    }
+
+    if (!json_path.empty() && !write_json(json_path, runner.results(), baseline.tolerances)) {
+        std::cerr << "Error writing " << json_path << '\n';
+        return 1;
+    }
+    if (!baseline_path.empty()) {
+        // Left out on purpose: filtered, for another photo, or for a SIMD level or pool size this machine lacks
+        const std::vector<AsciiArt::SimdLevel> levels = supported_levels();
+        const std::string pooled = std::format("image_to_ascii/{}t", pool.size());
+        const auto left_out = [&](const Result& base) {
+            if (base.name.find(settings.filter) == std::string_view::npos || (custom_photo && base.input == "photo")) {
+                return true;
+            }
+            if (base.name.starts_with("image_to_ascii/")) {
+                return base.name != pooled;
+            }
+            for (const AsciiArt::SimdLevel level : {AsciiArt::SimdLevel::SSE41, AsciiArt::SimdLevel::AVX2}) {
+                if (base.name == std::format("rgb_row/{}", simd_level_name(level)) &&
+                    std::find(levels.begin(), levels.end(), level) == levels.end()) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        ok = compare_with_baseline(baseline, runner.results(), timing, left_out) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Generates deterministic test clips with ffmpeg's lavfi sources, runs `vid2ascii --benchmark` over each and
+# collects the per-clip reports into one JSON file.
+#
+# Usage: bench/playback_bench.sh [REPORT]   (default playback_report.json)
+# Environment: FFMPEG, VID2ASCII, CLIP_DIR (default bench/clips), DURATION in seconds (default 5), and any extra
+# vid2ascii options in VID2ASCII_OPTIONS.
+
+set -eu
+
+FFMPEG=${FFMPEG:-ffmpeg}
+VID2ASCII=${VID2ASCII:-./vid2ascii}
+CLIP_DIR=${CLIP_DIR:-bench/clips}
+DURATION=${DURATION:-5}
+VID2ASCII_OPTIONS=${VID2ASCII_OPTIONS:-}
+REPORT=${1:-playback_report.json}
+
+H264="-c:v libx264 -preset veryfast -pix_fmt yuv420p -g 60"
+VP9="-c:v libvpx-vp9 -deadline realtime -cpu-used 8 -b:v 8M -pix_fmt yuv420p -g 60"
+
+# name, lavfi source graph, encoder options. Clips are only generated once per duration and kept in CLIP_DIR.
+CLIPS="
+testsrc_480p.mp4|testsrc2=size=854x480:rate=30|$H264
+mandelbrot_720p.mp4|mandelbrot=size=1280x720:rate=30|$H264
+noise_1080p.mp4|color=c=gray:size=1920x1080:rate=30,noise=alls=60:allf=t+u:all_seed=1|$H264
+static_1080p.mp4|smptehdbars=size=1920x1080:rate=30|$H264
+pan_1080p.webm|testsrc2=size=3840x1080:rate=30,scroll=horizontal=0.01,crop=1920:1080:0:0|$VP9
+pan_2160p.webm|testsrc2=size=3840x2160:rate=30,scroll=horizontal=0.01|$VP9
+"
+
+if [ ! -x "$VID2ASCII" ]; then
+    echo "vid2ascii not found at $VID2ASCII, run make first" >&2
+    exit 1
+fi
+
+mkdir -p "$CLIP_DIR/$DURATION"s
+runs=$(mktemp -d)
+trap 'rm -rf "$runs"' EXIT
+
+echo "$CLIPS" | while IFS='|' read -r name source encoder; do
+    [ -n "$name" ] || continue
+    clip="$CLIP_DIR/${DURATION}s/$name"
+    if [ ! -f "$clip" ]; then
+        echo "Generating $clip" >&2
+        # Bitexact flags keep the output identical across runs of the same ffmpeg build
+        # shellcheck disable=SC2086
+        "$FFMPEG" -hide_banner -loglevel error -y -f lavfi -i "$source" -t "$DURATION" $encoder \
+            -fflags +bitexact -flags:v +bitexact -threads 1 "$clip.tmp.${name##*.}"
+        mv "$clip.tmp.${name##*.}" "$clip"
+    fi
+
+    echo "Benchmarking $name" >&2
+    # shellcheck disable=SC2086
+    "$VID2ASCII" $VID2ASCII_OPTIONS --report "$runs/$name.json" "$clip" >&2
+done
+
+{
+    printf '{"duration": %s, "options": "%s", "clips": [\n' "$DURATION" "$VID2ASCII_OPTIONS"
+    first=1
+    for name in $(echo "$CLIPS" | cut -d'|' -f1); do
+        [ -f "$runs/$name.json" ] || continue
+        [ "$first" -eq 1 ] || printf ',\n'
+        first=0
+        printf '{"clip": "%s", "report":\n' "$name"
+        cat "$runs/$name.json"
+        printf '}'
+    done
+    printf '\n]}\n'
+} > "$REPORT"
+
+echo "Wrote $REPORT" >&2
@@ -4,8 +4,15 @@
 #include "ffmpeg.hpp"
 #include "stb_image.h"
 #include "stb_image_resize2.h"
+#include "worker_pool.hpp"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -17,20 +24,331 @@ struct ColoredPixel {
     int colorIndex;
 };
 
+// Planar cell buffer holding one glyph byte and one 256-color palette index per cell
+struct CellFrame {
+    int width = 0;
+    int height = 0;
+    std::vector<char> glyphs;
+    std::vector<unsigned char> colors;
+
+    CellFrame() = default;
+    CellFrame(int w, int h);
+
+    void resize(int w, int h);
+
+    [[nodiscard]] size_t size() const {
+        return glyphs.size();
+    }
+
+    bool operator==(const CellFrame& other) const;
+};
+
 constexpr std::string_view ASCII_CHARS = ".:;=ox+*?SXE$O8NZHMW#BQ@";
 constexpr std::string_view COLOR_PREFIX = "\033[38;5;";
 constexpr std::string_view ANSI_RESET = "\033[0m";
+constexpr std::string_view CURSOR_HOME = "\033[H";
+
+// BT.709 luma weights in Q8 fixed point, they sum to 256 so luma fits in 16 bits
+constexpr int LUMA_R = 54;
+constexpr int LUMA_G = 183;
+constexpr int LUMA_B = 19;
+constexpr int LUMA_MAX = 255 << 8;
+
+// floor(v / 51) for v in [0, 255] computed as (v * CUBE_DIV_MUL) >> 16
+constexpr int CUBE_DIV_MUL = 1286;
+
+constexpr int luma_q8(const int r, const int g, const int b) {
+    return LUMA_R * r + LUMA_G * g + LUMA_B * b;
+}
+
+// Splits the Q8 luma range into ASCII_CHARS.length() equal bins
+constexpr size_t glyph_index(const int luma) {
+    return (static_cast<size_t>(luma) * ASCII_CHARS.length()) >> 16;
+}
+
+constexpr int cube_index(const int r, const int g, const int b) {
+    return 16 + (36 * ((r * CUBE_DIV_MUL) >> 16)) + (6 * ((g * CUBE_DIV_MUL) >> 16)) + ((b * CUBE_DIV_MUL) >> 16);
+}
+
+// Single color of every cell in mono mode, white in the color cube
+constexpr unsigned char MONO_COLOR = cube_index(255, 255, 255);
+
+// Y'CbCr -> R'G'B' coefficients in Q8 for one matrix and range. yScale also maps Y onto the Q8 luma range, so the
+// glyph comes straight from the Y plane.
+struct YuvMatrix {
+    int yOffset;
+    int yScale;
+    int crR;
+    int cbG;
+    int crG;
+    int cbB;
+};
+
+// BT.709 when tagged so, BT.601 otherwise like swscale
+YuvMatrix yuv_matrix(AVColorSpace colorspace, AVColorRange range);
+
+// Converts `count` pixels of a Y row and the matching chroma row. Each chroma sample covers 1 << chromaShift pixels
+// and consecutive samples are chromaStep bytes apart, which covers planar 4:4:4 and 4:2:0 as well as NV12.
+void yuv_row_to_ascii(const YuvMatrix& matrix, const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                      int count, int chromaShift, int chromaStep, char* glyphs, unsigned char* colors);
+
+// Glyphs from luma only, every cell gets MONO_COLOR
+void luma_row_to_ascii(const YuvMatrix& matrix, const unsigned char* y, int count, char* glyphs,
+                       unsigned char* colors);
+
+// Converts `count` packed RGB24 pixels into the glyph and color planes
+using RgbRowKernel = void (*)(const unsigned char* rgb, int count, char* glyphs, unsigned char* colors);
+
+enum class SimdLevel { Scalar, SSE41, AVX2 };
+
+SimdLevel detect_simd_level();
+RgbRowKernel rgb_row_kernel(SimdLevel level);
+
+void rgb_row_to_ascii_scalar(const unsigned char* rgb, int count, char* glyphs, unsigned char* colors);
+
+// Adds `count` bytes to 16-bit column sums, the vertical pass of AreaScaler
+using AccumulateRowKernel = void (*)(const unsigned char* row, int count, std::uint16_t* sums);
+
+AccumulateRowKernel accumulate_row_kernel(SimdLevel level);
+
+void accumulate_row_scalar(const unsigned char* row, int count, std::uint16_t* sums);
+
+// Box filter averaging every source pixel an output pixel covers, for the large downscale factors between a video
+// frame or photo and the terminal. Each output row reads its band of source rows once and is produced on its own,
+// so callers map it to cells right away instead of going through a scaled image. When upscaling, every output pixel
+// takes the nearest source pixel.
+class AreaScaler {
+public:
+    AreaScaler() = default;
+    // Planes of packed `channels`-byte pixels
+    AreaScaler(int srcW, int srcH, int dstW, int dstH, int channels);
+
+    // Writes output row `y`, dstW * channels bytes, from the plane starting at `data`
+    void scale_row(const unsigned char* data, ptrdiff_t stride, int y, unsigned char* out);
+
+    [[nodiscard]] bool matches(const int srcW, const int srcH, const int channels) const {
+        return srcW == srcW_ && srcH == srcH_ && channels == channels_;
+    }
+
+private:
+    // 16-bit sums hold this many rows of 255, taller bands are sampled evenly
+    static constexpr int MAX_ROWS = 0xFFFF / 0xFF;
+
+    int srcW_ = 0;
+    int srcH_ = 0;
+    int channels_ = 0;
+    std::vector<int> columns_; // Source column range [columns_[2x], columns_[2x + 1]) of output column x
+    std::vector<int> rows_;    // Same for rows
+    std::vector<std::uint16_t> sums_;
+    AccumulateRowKernel accumulate_ = accumulate_row_scalar;
+};
+
+// Precomputed RGB -> cell table indexed by the top `bits` bits of each channel
+class ColorLut {
+public:
+    static constexpr int MIN_BITS = 4;
+    static constexpr int MAX_BITS = 8;
+
+    explicit ColorLut(int bits = 6);
+
+    [[nodiscard]] int bits() const {
+        return bits_;
+    }
+
+    [[nodiscard]] size_t size_bytes() const {
+        return table_.size() * sizeof(Entry);
+    }
+
+    [[nodiscard]] ColoredPixel lookup(const unsigned char r, const unsigned char g, const unsigned char b) const {
+        const Entry entry = table_[(static_cast<size_t>(r >> shift_) << (2 * bits_)) |
+                                   (static_cast<size_t>(g >> shift_) << bits_) | static_cast<size_t>(b >> shift_)];
+        return {.ascii = entry.ascii, .colorIndex = entry.colorIndex};
+    }
+
+private:
+    struct Entry {
+        char ascii;
+        unsigned char colorIndex;
+    };
+
+    int bits_;
+    int shift_;
+    std::vector<Entry> table_;
+};
+
+// Output byte arena that keeps its capacity between frames
+class ByteBuffer {
+public:
+    void clear() {
+        size_ = 0;
+    }
+
+    void reserve(size_t capacity) {
+        if (capacity > bytes_.size()) {
+            bytes_.resize(capacity);
+        }
+    }
+
+    // Returns `n` writable bytes at the end of the buffer, growing it if needed
+    char* extend(const size_t n) {
+        if (size_ + n > bytes_.size()) {
+            reserve(std::max(size_ + n, bytes_.size() * 2));
+        }
+        char* end = bytes_.data() + size_;
+        size_ += n;
+        return end;
+    }
+
+    void append(const std::string_view str) {
+        std::memcpy(extend(str.size()), str.data(), str.size());
+    }
+
+    void push_back(const char c) {
+        *extend(1) = c;
+    }
+
+    // Shrinks or grows the used size within the current capacity
+    void resize(const size_t size) {
+        reserve(size);
+        size_ = size;
+    }
+
+    [[nodiscard]] const char* data() const {
+        return bytes_.data();
+    }
+
+    [[nodiscard]] size_t size() const {
+        return size_;
+    }
+
+    [[nodiscard]] size_t capacity() const {
+        return bytes_.size();
+    }
+
+    [[nodiscard]] std::string_view view() const {
+        return {bytes_.data(), size_};
+    }
+
+private:
+    std::vector<char> bytes_;
+    size_t size_ = 0;
+};
 
 std::string color_code(int colorIndex);
 
 ColoredPixel pixel_to_ascii(unsigned char r, unsigned char g, unsigned char b);
 ColoredPixel pixel_to_ascii(unsigned char pixel);
+ColoredPixel pixel_to_ascii(const ColorLut& lut, unsigned char r, unsigned char g, unsigned char b);
+
+void rgb_row_to_ascii_lut(const ColorLut& lut, const unsigned char* rgb, int count, char* glyphs,
+                          unsigned char* colors);
 
-std::vector<ColoredPixel> image_to_ascii(const unsigned char* image, int w, int h, int channels, int outputW,
-                                         int outputH);
-std::vector<ColoredPixel> frame_to_ascii(const AVFrame* frame, int w, int h, int channels);
+// Bytes a band of rows should touch between its source, cells and output, about the L2 cache of one core
+constexpr size_t BAND_BYTES = size_t{256} * 1024;
 
-void print_ascii_frame(const std::vector<ColoredPixel>& asciiArt, int w, int h);
+// Rows per band when each row touches `rowBytes` bytes, small enough to give every one of `threads` a band
+int band_rows(size_t rowBytes, int height, size_t threads);
+
+// When `lut` is given, RGB pixels are mapped through it instead of the arithmetic kernels. With a `pool`, row bands
+// are converted in parallel.
+CellFrame image_to_ascii(const unsigned char* image, int w, int h, int channels, int outputW, int outputH,
+                         const ColorLut* lut = nullptr, utils::WorkerPool* pool = nullptr);
+CellFrame frame_to_ascii(const AVFrame* frame, int w, int h, int channels, const ColorLut* lut = nullptr,
+                         utils::WorkerPool* pool = nullptr);
+// Same into a reused frame, which only allocates when it grows
+void frame_to_ascii(const AVFrame* frame, int w, int h, int channels, CellFrame& out, const ColorLut* lut = nullptr,
+                    utils::WorkerPool* pool = nullptr);
+
+// Upper bound of encode_ascii_frame output for a w x h frame
+size_t max_encoded_size(int w, int h);
+
+// Appends the colored frame to `out` from a precomputed table of the 256 color escapes, without allocating once
+// `out` has grown to max_encoded_size. An escape is only emitted when the color changes, the count is returned.
+size_t encode_ascii_frame(const CellFrame& asciiArt, ByteBuffer& out);
+
+// Upper bound of encode_ascii_diff output for a w x h frame
+size_t max_encoded_diff_size(int w, int h);
+
+// Appends cursor-addressed updates for the cells of `next` that differ from `shown`, the frame currently on screen.
+// Falls back to a full redraw from the top-left corner when that takes fewer bytes. Both frames must have the same
+// size. Returns the number of color escapes.
+size_t encode_ascii_diff(const CellFrame& shown, const CellFrame& next, ByteBuffer& out);
+
+// Band encoders for rows [rowBegin, rowEnd). A band assumes nothing about the cursor or color other bands leave
+// behind, so the bands of a frame can be encoded in parallel and written in order. encode_ascii_band is a redraw
+// starting with a move to the first cell of the band; encode_ascii_diff_band falls back to it when smaller and
+// appends nothing when the band did not change. Both return the number of color escapes.
+size_t encode_ascii_band(const CellFrame& frame, int rowBegin, int rowEnd, ByteBuffer& out);
+size_t encode_ascii_diff_band(const CellFrame& shown, const CellFrame& next, int rowBegin, int rowEnd,
+                              ByteBuffer& out);
+
+// Writes the whole buffer to a raw file descriptor, bypassing iostreams
+bool write_frame(int fd, const ByteBuffer& buffer);
+// Writes the buffers in order with writev
+bool write_frame(int fd, std::span<const ByteBuffer> buffers);
+
+void print_ascii_frame(const CellFrame& asciiArt);
+
+// Reusable converter for a fixed output size. It owns the row kernel, the optional lookup table and the resize
+// scratch, so converting and encoding video frames performs no heap allocations after the first frame. With a
+// `pool`, frames are converted and encoded in row bands across its threads.
+class Converter {
+public:
+    Converter(int outputW, int outputH, int lutBits = 0, utils::WorkerPool* pool = nullptr);
+
+    [[nodiscard]] int width() const {
+        return outputW_;
+    }
+
+    [[nodiscard]] int height() const {
+        return outputH_;
+    }
+
+    // `frame` must be at the output size in RGB24, YUV420P, NV12, YUV444P (or their full range J variants) or GRAY8,
+    // which converts in mono mode. The lookup table only applies to RGB24. Returns false for other formats.
+    [[nodiscard]] bool convert(const AVFrame& frame, CellFrame& out) const;
+    // Converts only rows [rowBegin, rowEnd), so a frame can be converted band by band while it is being scaled
+    [[nodiscard]] bool convert(const AVFrame& frame, int rowBegin, int rowEnd, CellFrame& out) const;
+    // Area averages a full size YUV420P, NV12 or YUV444P frame (or a J variant) straight into cells, only reading
+    // the luma plane when `mono`. Returns false for other formats.
+    [[nodiscard]] bool convert_area(const AVFrame& frame, bool mono, CellFrame& out);
+    static bool supports_area(int format);
+    // Downscales a packed 1-4 channel image by area averaging, or resizes it with stb when it is smaller than the
+    // output (stb allocates its own filter buffers)
+    void convert(const unsigned char* image, int w, int h, int channels, CellFrame& out);
+
+    // Encodes a full redraw starting from the top-left corner, returns the number of color escapes
+    size_t encode(const CellFrame& frame, ByteBuffer& out) const;
+    // Encodes only what changed since `shown` was drawn, or a full redraw when that is smaller or sizes differ
+    size_t encode_diff(const CellFrame& shown, const CellFrame& frame, ByteBuffer& out) const;
+    // Band parallel variants, one buffer per row band plus one for the end of the frame, for the writev overload of
+    // write_frame
+    size_t encode(const CellFrame& frame, std::vector<ByteBuffer>& bands) const;
+    size_t encode_diff(const CellFrame& shown, const CellFrame& frame, std::vector<ByteBuffer>& bands) const;
+
+private:
+    // Scratch of one row band of the area scalers
+    struct AreaBand {
+        AreaScaler luma; // Also packed images
+        AreaScaler chroma; // Both planes, or interleaved NV12
+        std::vector<unsigned char> row;
+    };
+
+    [[nodiscard]] bool convert_rows(const AVFrame& frame, int rowBegin, int rowEnd, CellFrame& out) const;
+    // Scratch for `count` bands with scalers from the given sources, kept between frames of the same size. No
+    // chroma scaler is set up when `chromaChannels` is 0.
+    std::span<AreaBand> area_bands(size_t count, int srcW, int srcH, int channels, int chromaW, int chromaH,
+                                   int chromaChannels);
+    [[nodiscard]] size_t threads() const;
+
+    int outputW_;
+    int outputH_;
+    RgbRowKernel kernel_;
+    std::optional<ColorLut> lut_;
+    utils::WorkerPool* pool_;
+    std::vector<unsigned char> scratch_;
+    std::vector<AreaBand> areaBands_;
+};
 
 } // namespace AsciiArt
 
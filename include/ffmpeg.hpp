@@ -4,6 +4,7 @@
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
 #include <libavutil/rational.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
@@ -0,0 +1,58 @@
+#ifndef FRAME_TIMELINE_HPP
+#define FRAME_TIMELINE_HPP
+
+#include "ffmpeg.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace utils {
+
+// Converts decoder timestamps to presentation times relative to the first frame. Gaps are capped at `max_gap` so
+// that a timestamp jump never stalls playback, missing timestamps advance by the nominal frame interval. Packets
+// skipped before decoding extend the cap by one frame interval each, so the gaps they leave, such as keyframe to
+// keyframe when only those are decoded, keep their real length.
+class FrameTimeline {
+public:
+    FrameTimeline(const AVRational time_base, const std::chrono::nanoseconds frame_interval,
+                  const std::chrono::nanoseconds max_gap)
+        : time_base_(time_base), frame_interval_(frame_interval), max_gap_(max_gap) {}
+
+    // A packet of the stream was dropped without being decoded
+    void skip() {
+        skipped_ += frame_interval_;
+    }
+
+    std::chrono::nanoseconds next(const std::int64_t timestamp) {
+        if (!first_) {
+            std::chrono::nanoseconds delta = frame_interval_;
+            if (timestamp != AV_NOPTS_VALUE && last_timestamp_ != AV_NOPTS_VALUE) {
+                delta = std::chrono::nanoseconds(av_rescale_q(timestamp - last_timestamp_, time_base_,
+                                                              {1, 1'000'000'000}));
+            }
+            const std::chrono::nanoseconds gap =
+                std::clamp(delta, std::chrono::nanoseconds::zero(), max_gap_ + skipped_);
+            pts_ += gap;
+            skipped_ = std::max(skipped_ - gap, std::chrono::nanoseconds::zero());
+        }
+        first_ = false;
+        if (timestamp != AV_NOPTS_VALUE) {
+            last_timestamp_ = timestamp;
+        }
+        return pts_;
+    }
+
+private:
+    AVRational time_base_;
+    std::chrono::nanoseconds frame_interval_;
+    std::chrono::nanoseconds max_gap_;
+    bool first_ = true;
+    std::int64_t last_timestamp_ = AV_NOPTS_VALUE;
+    std::chrono::nanoseconds pts_{0};
+    std::chrono::nanoseconds skipped_{0}; // Skipped packets not yet covered by a gap
+};
+
+} // namespace utils
+
+#endif // FRAME_TIMELINE_HPP
@@ -0,0 +1,113 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace utils {
+
+// Fixed-size log-linear histogram of durations in the style of HdrHistogram. Values below SUB_BUCKETS ns are kept
+// exactly, every power of two above is split into SUB_BUCKETS / 2 linear buckets, so percentiles are within 1.6% of
+// the recorded values. Recording is a branch when disabled and a few relaxed stores otherwise. Only one thread may
+// record into a histogram, any thread may read it meanwhile.
+class LatencyHistogram {
+public:
+    void enable() {
+        enabled_ = true;
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return enabled_;
+    }
+
+    void record(const std::chrono::nanoseconds duration) {
+        if (!enabled_) {
+            return;
+        }
+        const auto value = static_cast<std::uint64_t>(std::max<std::chrono::nanoseconds::rep>(duration.count(), 0));
+        increment(counts_[index(value)], 1);
+        increment(count_, 1);
+        increment(sum_, value);
+        if (value > max_.load(std::memory_order_relaxed)) {
+            max_.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    [[nodiscard]] std::uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds mean() const {
+        const std::uint64_t count = this->count();
+        return std::chrono::nanoseconds(count == 0 ? 0 : sum_.load(std::memory_order_relaxed) / count);
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds max() const {
+        return std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+    }
+
+    // Upper end of the bucket holding the `percent` percentile, at most the largest value recorded
+    [[nodiscard]] std::chrono::nanoseconds percentile(const double percent) const {
+        std::uint64_t total = 0;
+        for (const std::atomic<std::uint64_t>& count : counts_) {
+            total += count.load(std::memory_order_relaxed);
+        }
+        if (total == 0) {
+            return std::chrono::nanoseconds(0);
+        }
+
+        const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(percent / 100.0 * total)));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::chrono::nanoseconds(std::min(highest_value(i), max_.load(std::memory_order_relaxed)));
+            }
+        }
+        return max();
+    }
+
+private:
+    static constexpr int SUB_BUCKET_BITS = 7;
+    static constexpr std::uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr std::uint64_t HALF_BUCKETS = SUB_BUCKETS / 2;
+    static constexpr std::size_t BUCKETS = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * HALF_BUCKETS;
+
+    static std::size_t index(const std::uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        const int shift = std::bit_width(value) - SUB_BUCKET_BITS;
+        return SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + ((value >> shift) - HALF_BUCKETS);
+    }
+
+    static std::uint64_t highest_value(const std::size_t index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        const std::size_t shift = (index - SUB_BUCKETS) / HALF_BUCKETS + 1;
+        const std::uint64_t top = HALF_BUCKETS + (index - SUB_BUCKETS) % HALF_BUCKETS;
+        return ((top + 1) << shift) - 1;
+    }
+
+    // Single writer, so a load and store is enough and never a locked read-modify-write
+    static void increment(std::atomic<std::uint64_t>& counter, const std::uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    bool enabled_ = false;
+    std::array<std::atomic<std::uint64_t>, BUCKETS> counts_{};
+    std::atomic<std::uint64_t> count_{0};
+    std::atomic<std::uint64_t> sum_{0};
+    std::atomic<std::uint64_t> max_{0};
+};
+
+} // namespace utils
+
+#endif // LATENCY_HISTOGRAM_HPP
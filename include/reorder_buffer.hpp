@@ -0,0 +1,75 @@
+#ifndef REORDER_BUFFER_HPP
+#define REORDER_BUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace utils {
+
+// Window of `capacity` slots that producers fill out of order and one consumer takes back in sequence order. Slot
+// `sequence` is reused for sequence + capacity, so producers block until the consumer has moved past it. Any number
+// of producers may fill distinct sequences concurrently; each sequence is acquired and published by one of them.
+template <typename T>
+class ReorderBuffer {
+public:
+    explicit ReorderBuffer(const std::size_t capacity)
+        : capacity_(capacity), slots_(std::make_unique<Slot[]>(capacity)) {}
+
+    ReorderBuffer(const ReorderBuffer&) = delete;
+    ReorderBuffer& operator=(const ReorderBuffer&) = delete;
+
+    // Producer side, blocks until `sequence` is within the window
+    T& acquire(const std::size_t sequence) {
+        std::size_t head = head_.load(std::memory_order_acquire);
+        while (sequence - head >= capacity_) {
+            head_.wait(head, std::memory_order_acquire);
+            head = head_.load(std::memory_order_acquire);
+        }
+        return slots_[sequence % capacity_].value;
+    }
+
+    void publish(const std::size_t sequence) {
+        Slot& slot = slots_[sequence % capacity_];
+        slot.published.store(sequence + 1, std::memory_order_release);
+        slot.published.notify_one();
+    }
+
+    // Consumer side, blocks until the next sequence is published
+    T& front() {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        Slot& slot = slots_[head % capacity_];
+        std::size_t published = slot.published.load(std::memory_order_acquire);
+        while (published != head + 1) {
+            slot.published.wait(published, std::memory_order_acquire);
+            published = slot.published.load(std::memory_order_acquire);
+        }
+        return slot.value;
+    }
+
+    // Consumer side, hands the front slot back to the producers
+    void pop() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        head_.notify_all();
+    }
+
+    [[nodiscard]] std::size_t capacity() const {
+        return capacity_;
+    }
+
+private:
+    static constexpr std::size_t CACHE_LINE = 64;
+
+    struct alignas(CACHE_LINE) Slot {
+        T value{};
+        std::atomic<std::size_t> published{0}; // Sequence + 1 of the value, 0 before the first
+    };
+
+    const std::size_t capacity_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(CACHE_LINE) std::atomic<std::size_t> head_{0}; // Next sequence the consumer takes
+};
+
+} // namespace utils
+
+#endif // REORDER_BUFFER_HPP
@@ -0,0 +1,124 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <utility>
+
+namespace utils {
+
+// Bounded lock-free queue for exactly one producer and one consumer thread. Blocking push/pop sleep on the
+// opposite index with C++20 atomic waits instead of spinning.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(const std::size_t capacity) : capacity_(capacity), slots_(std::make_unique<T[]>(capacity)) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    bool try_push(T value) {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == capacity_) {
+            return false;
+        }
+        slots_[tail % capacity_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        tail_.notify_one();
+        return true;
+    }
+
+    bool try_pop(T& out) {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        out = std::move(slots_[head % capacity_]);
+        head_.store(head + 1, std::memory_order_release);
+        head_.notify_one();
+        return true;
+    }
+
+    void push(T value) {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        std::size_t head = head_.load(std::memory_order_acquire);
+        while (tail - head == capacity_) {
+            head_.wait(head, std::memory_order_acquire);
+            head = head_.load(std::memory_order_acquire);
+        }
+        slots_[tail % capacity_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        tail_.notify_one();
+    }
+
+    T pop() {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        std::size_t tail = tail_.load(std::memory_order_acquire);
+        while (head == tail) {
+            tail_.wait(tail, std::memory_order_acquire);
+            tail = tail_.load(std::memory_order_acquire);
+        }
+        T value = std::move(slots_[head % capacity_]);
+        head_.store(head + 1, std::memory_order_release);
+        head_.notify_one();
+        return value;
+    }
+
+    [[nodiscard]] std::size_t capacity() const {
+        return capacity_;
+    }
+
+private:
+    static constexpr std::size_t CACHE_LINE = 64;
+
+    const std::size_t capacity_;
+    std::unique_ptr<T[]> slots_;
+    alignas(CACHE_LINE) std::atomic<std::size_t> head_{0};
+    alignas(CACHE_LINE) std::atomic<std::size_t> tail_{0};
+};
+
+// Fixed set of pooled items cycling between one producer and one consumer thread. The producer acquires a free
+// item, fills it and publishes it; the consumer receives it and releases it back once done. Items are never copied
+// or reallocated, only pointers travel through the two queues.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(const std::span<T> items) : free_(items.size()), filled_(items.size() + 1) {
+        for (T& item : items) {
+            free_.push(&item);
+        }
+    }
+
+    // Producer side, blocks until the consumer has released an item
+    T* acquire() {
+        return free_.pop();
+    }
+
+    void publish(T* item) {
+        filled_.push(item);
+    }
+
+    // Producer side, makes receive() return nullptr after the published items
+    void close() {
+        filled_.push(nullptr);
+    }
+
+    // Consumer side, blocks until an item is published, returns nullptr once the ring is closed
+    T* receive() {
+        return filled_.pop();
+    }
+
+    void release(T* item) {
+        free_.push(item);
+    }
+
+private:
+    SpscQueue<T*> free_;
+    SpscQueue<T*> filled_;
+};
+
+} // namespace utils
+
+#endif // SPSC_QUEUE_HPP
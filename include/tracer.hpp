@@ -0,0 +1,164 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace utils {
+
+// Timeline of spans per thread, written in the Chrome trace-event format (chrome://tracing, Perfetto). Threads
+// attach once to get a buffer of their own, reserved up front; recording into it takes no lock and never allocates,
+// so tracing does not shift the timings it records. Spans past a full buffer are dropped and counted. Only one
+// tracer may exist at a time, and it must be written after the attached threads are joined.
+class Tracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit Tracer(const std::size_t spans_per_thread) : capacity_(spans_per_thread), origin_(Clock::now()) {
+        active_.store(this, std::memory_order_release);
+    }
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    ~Tracer() {
+        active_.store(nullptr, std::memory_order_release);
+        buffer_ = nullptr;
+    }
+
+    // Gives the calling thread a buffer in the active tracer, shown as `name` in the trace. Without one, threads
+    // record nothing.
+    static void attach_thread(const std::string_view name) {
+        Tracer* tracer = active_.load(std::memory_order_acquire);
+        if (tracer == nullptr) {
+            return;
+        }
+        const std::lock_guard lock(tracer->mutex_);
+        auto buffer = std::make_unique<ThreadBuffer>();
+        buffer->name = name;
+        buffer->id = static_cast<int>(tracer->buffers_.size()) + 1;
+        buffer->spans.reserve(tracer->capacity_);
+        buffer_ = tracer->buffers_.emplace_back(std::move(buffer)).get();
+    }
+
+    [[nodiscard]] static bool enabled() {
+        return buffer_ != nullptr;
+    }
+
+    // `name` and `arg_name` must outlive the tracer, string literals in practice
+    static void record(const char* name, const char* arg_name, const std::uint64_t arg, const Clock::time_point begin,
+                       const Clock::time_point end) {
+        ThreadBuffer* buffer = buffer_;
+        if (buffer == nullptr) {
+            return;
+        }
+        if (buffer->spans.size() == buffer->spans.capacity()) {
+            ++buffer->dropped;
+            return;
+        }
+        buffer->spans.push_back({.name = name, .arg_name = arg_name, .arg = arg, .begin = begin, .end = end});
+    }
+
+    bool write(const std::filesystem::path& path) const {
+        std::ofstream out(path);
+        if (!out) {
+            return false;
+        }
+        const auto microseconds = [&](const Clock::time_point time) {
+            return std::chrono::duration<double, std::micro>(time - origin_).count();
+        };
+
+        const std::lock_guard lock(mutex_);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        for (const std::unique_ptr<ThreadBuffer>& buffer : buffers_) {
+            out << (first ? "" : ",\n")
+                << std::format("{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, "
+                               "\"args\": {{\"name\": \"{}\"}}}}",
+                               buffer->id, buffer->name);
+            first = false;
+            for (const Span& span : buffer->spans) {
+                out << std::format(",\n{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": 1, \"tid\": {}, \"ts\": {:.3f}, "
+                                   "\"dur\": {:.3f}, \"args\": {{\"{}\": {}}}}}",
+                                   span.name, buffer->id, microseconds(span.begin),
+                                   microseconds(span.end) - microseconds(span.begin), span.arg_name, span.arg);
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out);
+    }
+
+    // Spans lost to full buffers, across all threads
+    [[nodiscard]] std::uint64_t dropped() const {
+        const std::lock_guard lock(mutex_);
+        std::uint64_t dropped = 0;
+        for (const std::unique_ptr<ThreadBuffer>& buffer : buffers_) {
+            dropped += buffer->dropped;
+        }
+        return dropped;
+    }
+
+private:
+    struct Span {
+        const char* name;
+        const char* arg_name;
+        std::uint64_t arg;
+        Clock::time_point begin;
+        Clock::time_point end;
+    };
+
+    struct ThreadBuffer {
+        std::string name;
+        int id = 0;
+        std::vector<Span> spans;
+        std::uint64_t dropped = 0;
+    };
+
+    static inline std::atomic<Tracer*> active_{nullptr};
+    static inline thread_local ThreadBuffer* buffer_ = nullptr;
+
+    const std::size_t capacity_;
+    const Clock::time_point origin_;
+    mutable std::mutex mutex_; // Guards the list of buffers, never the recording
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+// Records the span from construction to destruction on the calling thread
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const char* arg_name, const std::uint64_t arg)
+        : name_(name), arg_name_(arg_name), arg_(arg) {
+        if (Tracer::enabled()) {
+            begin_ = Tracer::Clock::now();
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan() {
+        if (Tracer::enabled()) {
+            Tracer::record(name_, arg_name_, arg_, begin_, Tracer::Clock::now());
+        }
+    }
+
+private:
+    const char* name_;
+    const char* arg_name_;
+    std::uint64_t arg_;
+    Tracer::Clock::time_point begin_;
+};
+
+} // namespace utils
+
+#endif // TRACER_HPP
@@ -0,0 +1,120 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace utils {
+
+// Fixed set of threads running one parallel-for at a time. The calling thread takes part in every run, so a pool of
+// `threads` spawns threads - 1 workers. Every worker checks in once per run before run() returns, which keeps
+// stragglers of one run from picking up indices of the next.
+class WorkerPool {
+public:
+    explicit WorkerPool(const std::size_t threads) {
+        for (std::size_t i = 1; i < threads; ++i) {
+            workers_.emplace_back([this] { loop(); });
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() {
+        {
+            const std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return workers_.size() + 1;
+    }
+
+    // Calls fn(i) for every i in [0, count) and returns once all calls have returned
+    template <typename F>
+    void run(const std::size_t count, F&& fn) {
+        if (workers_.empty() || count <= 1) {
+            for (std::size_t i = 0; i < count; ++i) {
+                fn(i);
+            }
+            return;
+        }
+
+        {
+            const std::lock_guard lock(mutex_);
+            invoke_ = [](void* context, const std::size_t i) {
+                (*static_cast<std::remove_reference_t<F>*>(context))(i);
+            };
+            context_ = const_cast<void*>(static_cast<const void*>(&fn));
+            count_ = count;
+            next_.store(0, std::memory_order_relaxed);
+            busy_ = workers_.size();
+            ++generation_;
+        }
+        start_.notify_all();
+
+        work();
+
+        std::unique_lock lock(mutex_);
+        done_.wait(lock, [this] { return busy_ == 0; });
+    }
+
+private:
+    void loop() {
+        std::uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock lock(mutex_);
+                start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) {
+                    return;
+                }
+                seen = generation_;
+            }
+
+            work();
+
+            const std::lock_guard lock(mutex_);
+            if (--busy_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    void work() {
+        for (std::size_t i = next_.fetch_add(1, std::memory_order_relaxed); i < count_;
+             i = next_.fetch_add(1, std::memory_order_relaxed)) {
+            invoke_(context_, i);
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    bool stop_ = false;
+    std::uint64_t generation_ = 0;
+    std::size_t busy_ = 0; // Workers still in the current run
+
+    // Current run, written under the mutex before the generation changes
+    void (*invoke_)(void*, std::size_t) = nullptr;
+    void* context_ = nullptr;
+    std::size_t count_ = 0;
+    std::atomic<std::size_t> next_{0};
+};
+
+} // namespace utils
+
+#endif // WORKER_POOL_HPP
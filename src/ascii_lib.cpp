@@ -1,26 +1,71 @@
 #include "ascii_lib.hpp"
 
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <atomic>
+#include <charconv>
+#include <climits>
+#include <cstring>
 #include <format>
 #include <ostream>
-#include <sstream>
+
+#include <sys/uio.h>
+#include <unistd.h>
 
 namespace AsciiArt {
 
+static_assert(glyph_index(luma_q8(0, 0, 0)) == 0);
+static_assert(glyph_index(luma_q8(255, 255, 255)) == ASCII_CHARS.length() - 1);
+static_assert(glyph_index(luma_q8(128, 128, 128)) == ASCII_CHARS.length() / 2);
+static_assert(glyph_index(luma_q8(0, 255, 0)) > glyph_index(luma_q8(255, 0, 0)));
+static_assert(glyph_index(luma_q8(255, 0, 0)) > glyph_index(luma_q8(0, 0, 255)));
+
+CellFrame::CellFrame(const int w, const int h) {
+    resize(w, h);
+}
+
+void CellFrame::resize(const int w, const int h) {
+    width = w;
+    height = h;
+    glyphs.resize(static_cast<size_t>(w) * h);
+    colors.resize(static_cast<size_t>(w) * h);
+}
+
+bool CellFrame::operator==(const CellFrame& other) const {
+    return width == other.width && height == other.height &&
+           std::memcmp(glyphs.data(), other.glyphs.data(), glyphs.size()) == 0 &&
+           std::memcmp(colors.data(), other.colors.data(), colors.size()) == 0;
+}
+
+ColorLut::ColorLut(const int bits)
+    : bits_(std::clamp(bits, MIN_BITS, MAX_BITS)), shift_(8 - bits_), table_(size_t{1} << (3 * bits_)) {
+    // Each bin is represented by its center value
+    const int half = (1 << shift_) >> 1;
+    const int levels = 1 << bits_;
+
+    size_t i = 0;
+    for (int r = 0; r < levels; ++r) {
+        for (int g = 0; g < levels; ++g) {
+            for (int b = 0; b < levels; ++b) {
+                const auto [ascii, colorIndex] =
+                    pixel_to_ascii(static_cast<unsigned char>((r << shift_) | half),
+                                   static_cast<unsigned char>((g << shift_) | half),
+                                   static_cast<unsigned char>((b << shift_) | half));
+                table_[i++] = {.ascii = ascii, .colorIndex = static_cast<unsigned char>(colorIndex)};
+            }
+        }
+    }
+}
+
 std::string color_code(const int colorIndex) {
     return std::format("{}{}m", COLOR_PREFIX, colorIndex);
 }
 
 ColoredPixel pixel_to_ascii(const unsigned char r, const unsigned char g, const unsigned char b) {
     // Convert to grayscale and then to ASCII
-    const float rf = static_cast<float>(r) / 255.0F;
-    const float gf = static_cast<float>(g) / 255.0F;
-    const float bf = static_cast<float>(b) / 255.0F;
-
-    const float pixel = 0.2126F * rf + 0.7152F * gf + 0.0722F * bf;
-    const char ascii = ASCII_CHARS[static_cast<size_t>(pixel) * (ASCII_CHARS.length() - 1)];
-
-    const int colorIndex = 16 + (36 * (r / 51)) + (6 * (g / 51)) + (b / 51);
+    const char ascii = ASCII_CHARS[glyph_index(luma_q8(r, g, b))];
+    const int colorIndex = cube_index(r, g, b);
     return {.ascii = ascii, .colorIndex = colorIndex};
 }
 
@@ -28,61 +73,961 @@ ColoredPixel pixel_to_ascii(const unsigned char pixel) {
     return pixel_to_ascii(pixel, pixel, pixel);
 }
 
-std::vector<ColoredPixel> image_to_ascii(const unsigned char* image, const int w, const int h, const int channels,
-                                         const int outputW, const int outputH) {
+ColoredPixel pixel_to_ascii(const ColorLut& lut, const unsigned char r, const unsigned char g, const unsigned char b) {
+    return lut.lookup(r, g, b);
+}
+
+void rgb_row_to_ascii_lut(const ColorLut& lut, const unsigned char* rgb, const int count, char* glyphs,
+                          unsigned char* colors) {
+    for (int i = 0; i < count; ++i) {
+        const auto [ascii, colorIndex] = lut.lookup(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+        glyphs[i] = ascii;
+        colors[i] = static_cast<unsigned char>(colorIndex);
+    }
+}
+
+void rgb_row_to_ascii_scalar(const unsigned char* rgb, const int count, char* glyphs, unsigned char* colors) {
+    for (int i = 0; i < count; ++i) {
+        const auto [ascii, colorIndex] = pixel_to_ascii(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+        glyphs[i] = ascii;
+        colors[i] = static_cast<unsigned char>(colorIndex);
+    }
+}
+
+YuvMatrix yuv_matrix(const AVColorSpace colorspace, const AVColorRange range) {
+    const bool bt709 = colorspace == AVCOL_SPC_BT709;
+    if (range == AVCOL_RANGE_JPEG) {
+        return bt709 ? YuvMatrix{.yOffset = 0, .yScale = 256, .crR = 403, .cbG = 48, .crG = 120, .cbB = 475}
+                     : YuvMatrix{.yOffset = 0, .yScale = 256, .crR = 359, .cbG = 88, .crG = 183, .cbB = 454};
+    }
+    // Limited range scales Y from [16, 235] and chroma from [16, 240]
+    return bt709 ? YuvMatrix{.yOffset = 16, .yScale = 298, .crR = 459, .cbG = 55, .crG = 136, .cbB = 541}
+                 : YuvMatrix{.yOffset = 16, .yScale = 298, .crR = 409, .cbG = 100, .crG = 208, .cbB = 516};
+}
+
+namespace {
+
+template <int ChromaShift, int ChromaStep>
+void yuv_row(const YuvMatrix& m, const unsigned char* y, const unsigned char* u, const unsigned char* v,
+             const int count, char* glyphs, unsigned char* colors) {
+    for (int x = 0; x < count; ++x) {
+        const int c = (x >> ChromaShift) * ChromaStep;
+        const int luma = (y[x] - m.yOffset) * m.yScale;
+        const int cb = u[c] - 128;
+        const int cr = v[c] - 128;
+
+        const int r = std::clamp((luma + m.crR * cr + 128) >> 8, 0, 255);
+        const int g = std::clamp((luma - m.cbG * cb - m.crG * cr + 128) >> 8, 0, 255);
+        const int b = std::clamp((luma + m.cbB * cb + 128) >> 8, 0, 255);
+
+        glyphs[x] = ASCII_CHARS[glyph_index(std::clamp(luma, 0, LUMA_MAX))];
+        colors[x] = static_cast<unsigned char>(cube_index(r, g, b));
+    }
+}
+
+} // namespace
+
+void yuv_row_to_ascii(const YuvMatrix& matrix, const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                      const int count, const int chromaShift, const int chromaStep, char* glyphs,
+                      unsigned char* colors) {
+    if (chromaShift == 0 && chromaStep == 1) {
+        yuv_row<0, 1>(matrix, y, u, v, count, glyphs, colors);
+    } else if (chromaShift == 0) {
+        yuv_row<0, 2>(matrix, y, u, v, count, glyphs, colors);
+    } else if (chromaStep == 1) {
+        yuv_row<1, 1>(matrix, y, u, v, count, glyphs, colors);
+    } else {
+        yuv_row<1, 2>(matrix, y, u, v, count, glyphs, colors);
+    }
+}
+
+void luma_row_to_ascii(const YuvMatrix& matrix, const unsigned char* y, const int count, char* glyphs,
+                       unsigned char* colors) {
+    for (int x = 0; x < count; ++x) {
+        glyphs[x] = ASCII_CHARS[glyph_index(std::clamp((y[x] - matrix.yOffset) * matrix.yScale, 0, LUMA_MAX))];
+    }
+    std::memset(colors, MONO_COLOR, static_cast<size_t>(count));
+}
+
+void accumulate_row_scalar(const unsigned char* row, const int count, std::uint16_t* sums) {
+    for (int i = 0; i < count; ++i) {
+        sums[i] = static_cast<std::uint16_t>(sums[i] + row[i]);
+    }
+}
+
+namespace {
+
+// Source range [begin, end) of each of `dst` output pixels, never empty
+std::vector<int> area_ranges(const int src, const int dst) {
+    std::vector<int> ranges(static_cast<size_t>(dst) * 2);
+    for (int i = 0; i < dst; ++i) {
+        const auto begin = static_cast<int>(static_cast<std::int64_t>(i) * src / dst);
+        const auto end = static_cast<int>(static_cast<std::int64_t>(i + 1) * src / dst);
+        ranges[static_cast<size_t>(i) * 2] = begin;
+        ranges[static_cast<size_t>(i) * 2 + 1] = std::max(end, begin + 1);
+    }
+    return ranges;
+}
+
+} // namespace
+
+AreaScaler::AreaScaler(const int srcW, const int srcH, const int dstW, const int dstH, const int channels)
+    : srcW_(srcW), srcH_(srcH), channels_(channels), columns_(area_ranges(srcW, dstW)), rows_(area_ranges(srcH, dstH)),
+      sums_(static_cast<size_t>(srcW) * channels), accumulate_(accumulate_row_kernel(detect_simd_level())) {}
+
+void AreaScaler::scale_row(const unsigned char* data, const ptrdiff_t stride, const int y, unsigned char* out) {
+    const int first = rows_[static_cast<size_t>(y) * 2];
+    const int last = rows_[static_cast<size_t>(y) * 2 + 1];
+    const int step = (last - first + MAX_ROWS - 1) / MAX_ROWS;
+
+    std::fill(sums_.begin(), sums_.end(), 0);
+    int count = 0;
+    for (int row = first; row < last; row += step) {
+        accumulate_(data + row * stride, srcW_ * channels_, sums_.data());
+        ++count;
+    }
+
+    const size_t dstW = columns_.size() / 2;
+    if (channels_ == 1) {
+        for (size_t x = 0; x < dstW; ++x) {
+            const int begin = columns_[x * 2];
+            const int end = columns_[x * 2 + 1];
+            std::uint32_t sum = 0;
+            for (int i = begin; i < end; ++i) {
+                sum += sums_[static_cast<size_t>(i)];
+            }
+            const auto area = static_cast<std::uint32_t>(count * (end - begin));
+            out[x] = static_cast<unsigned char>((sum + area / 2) / area);
+        }
+        return;
+    }
+
+    for (size_t x = 0; x < dstW; ++x) {
+        const int begin = columns_[x * 2];
+        const int end = columns_[x * 2 + 1];
+        const auto area = static_cast<std::uint32_t>(count * (end - begin));
+
+        for (int c = 0; c < channels_; ++c) {
+            std::uint32_t sum = 0;
+            for (int i = begin; i < end; ++i) {
+                sum += sums_[static_cast<size_t>(i) * channels_ + c];
+            }
+            out[x * channels_ + c] = static_cast<unsigned char>((sum + area / 2) / area);
+        }
+    }
+}
+
+int band_rows(const size_t rowBytes, const int height, const size_t threads) {
+    if (height <= 0) {
+        return 1;
+    }
+    const auto fitting = static_cast<int>(std::min<size_t>(BAND_BYTES / std::max<size_t>(rowBytes, 1), height));
+    const auto perThread = static_cast<int>((static_cast<size_t>(height) + threads - 1) / std::max<size_t>(threads, 1));
+    return std::max(1, std::min(fitting, perThread));
+}
+
+namespace {
+
+size_t band_count(const int rowBegin, const int rowEnd, const int rows) {
+    return rowEnd > rowBegin ? static_cast<size_t>((rowEnd - rowBegin + rows - 1) / rows) : 0;
+}
+
+// Calls fn(band, bandBegin, bandEnd) for the bands of `rows` rows covering [rowBegin, rowEnd), on the pool if any
+template <typename F>
+void for_each_band(utils::WorkerPool* pool, const int rowBegin, const int rowEnd, const int rows, F&& fn) {
+    const auto run_band = [&](const size_t band) {
+        const int bandBegin = rowBegin + static_cast<int>(band) * rows;
+        fn(band, bandBegin, std::min(bandBegin + rows, rowEnd));
+    };
+
+    const size_t count = band_count(rowBegin, rowEnd, rows);
+    if (pool != nullptr) {
+        pool->run(count, run_band);
+        return;
+    }
+    for (size_t band = 0; band < count; ++band) {
+        run_band(band);
+    }
+}
+
+size_t pool_threads(const utils::WorkerPool* pool) {
+    return pool != nullptr ? pool->size() : 1;
+}
+
+// Source bytes read per output row when area averaging, plus the cells written
+size_t area_row_bytes(const ptrdiff_t stride, const int srcH, const int dstH, const int dstW) {
+    const size_t srcRows = static_cast<size_t>(srcH + dstH - 1) / static_cast<size_t>(std::max(dstH, 1));
+    return srcRows * static_cast<size_t>(std::abs(stride)) + static_cast<size_t>(dstW) * 2;
+}
+
+void convert_row(const unsigned char* row, const int w, const int channels, const RgbRowKernel kernel,
+                 const ColorLut* lut, char* glyphs, unsigned char* colors) {
+    if (channels == 3 && lut != nullptr) {
+        rgb_row_to_ascii_lut(*lut, row, w, glyphs, colors);
+        return;
+    }
+    if (channels == 3) {
+        kernel(row, w, glyphs, colors);
+        return;
+    }
+
+    for (int x = 0; x < w; ++x) {
+        const unsigned char* pixel = &row[x * channels];
+        ColoredPixel cell{};
+        if (channels < 3) {
+            cell = pixel_to_ascii(pixel[0]);
+        } else if (lut != nullptr) {
+            cell = pixel_to_ascii(*lut, pixel[0], pixel[1], pixel[2]);
+        } else {
+            cell = pixel_to_ascii(pixel[0], pixel[1], pixel[2]);
+        }
+        glyphs[x] = cell.ascii;
+        colors[x] = static_cast<unsigned char>(cell.colorIndex);
+    }
+}
+
+// Converts rows [rowBegin, rowEnd) of `out`, `data` points at the first row of the image
+void convert_rows(const unsigned char* data, const ptrdiff_t stride, const int channels, const RgbRowKernel kernel,
+                  const ColorLut* lut, const int rowBegin, const int rowEnd, CellFrame& out) {
+    const int w = out.width;
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        const size_t offset = static_cast<size_t>(y) * w;
+        convert_row(data + y * stride, w, channels, kernel, lut, &out.glyphs[offset], &out.colors[offset]);
+    }
+}
+
+// Area averages rows [rowBegin, rowEnd) of a packed image one output row at a time into `row`, converting each row
+// right away
+void convert_area_rows(const unsigned char* image, const int channels, AreaScaler& scaler,
+                       std::vector<unsigned char>& row, const RgbRowKernel kernel, const ColorLut* lut,
+                       const ptrdiff_t stride, const int rowBegin, const int rowEnd, CellFrame& out) {
+    const int w = out.width;
+    row.resize(static_cast<size_t>(w) * channels);
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        scaler.scale_row(image, stride, y, row.data());
+        const size_t offset = static_cast<size_t>(y) * w;
+        convert_row(row.data(), w, channels, kernel, lut, &out.glyphs[offset], &out.colors[offset]);
+    }
+}
+
+} // namespace
+
+CellFrame image_to_ascii(const unsigned char* image, const int w, const int h, const int channels, const int outputW,
+                         const int outputH, const ColorLut* lut, utils::WorkerPool* pool) {
+    const RgbRowKernel kernel = rgb_row_kernel(detect_simd_level());
+    const auto stride = static_cast<ptrdiff_t>(w) * channels;
+    CellFrame asciiArt(outputW, outputH);
+
+    if (w >= outputW && h >= outputH) {
+        const int rows = band_rows(area_row_bytes(stride, h, outputH, outputW), outputH, pool_threads(pool));
+        // The scalers keep per-row sums, every band gets its own
+        const AreaScaler scaler(w, h, outputW, outputH, channels);
+        std::vector<AreaScaler> scalers(band_count(0, outputH, rows), scaler);
+        std::vector<std::vector<unsigned char>> bandRows(scalers.size());
+
+        for_each_band(pool, 0, outputH, rows, [&](const size_t band, const int rowBegin, const int rowEnd) {
+            convert_area_rows(image, channels, scalers[band], bandRows[band], kernel, lut, stride, rowBegin, rowEnd,
+                              asciiArt);
+        });
+        return asciiArt;
+    }
+
     // Resize the image
     std::vector<unsigned char> resizedImg(static_cast<size_t>(outputW * outputH * channels));
     stbir_resize_uint8_linear(image, w, h, 0, resizedImg.data(), outputW, outputH, 0,
                               static_cast<stbir_pixel_layout>(channels));
 
-    std::vector<ColoredPixel> asciiArt(static_cast<size_t>(outputW * outputH));
+    const auto resizedStride = static_cast<ptrdiff_t>(outputW) * channels;
+    const int rows = band_rows(static_cast<size_t>(resizedStride) + static_cast<size_t>(outputW) * 2, outputH,
+                               pool_threads(pool));
+    for_each_band(pool, 0, outputH, rows, [&](size_t, const int rowBegin, const int rowEnd) {
+        convert_rows(resizedImg.data(), resizedStride, channels, kernel, lut, rowBegin, rowEnd, asciiArt);
+    });
 
-    if (channels >= 3) {
-        for (int i = 0; i < outputW * outputH; ++i) {
-            const int curr = i * channels;
-            asciiArt[i] = pixel_to_ascii(resizedImg[curr], resizedImg[curr + 1], resizedImg[curr + 2]);
+    return asciiArt;
+}
+
+CellFrame frame_to_ascii(const AVFrame* frame, const int w, const int h, const int channels, const ColorLut* lut,
+                         utils::WorkerPool* pool) {
+    CellFrame asciiArt;
+    frame_to_ascii(frame, w, h, channels, asciiArt, lut, pool);
+    return asciiArt;
+}
+
+void frame_to_ascii(const AVFrame* frame, const int w, const int h, const int channels, CellFrame& out,
+                    const ColorLut* lut, utils::WorkerPool* pool) {
+    const RgbRowKernel kernel = rgb_row_kernel(detect_simd_level());
+    out.resize(w, h);
+
+    const int rows = band_rows(static_cast<size_t>(frame->linesize[0]) + static_cast<size_t>(w) * 2, h,
+                               pool_threads(pool));
+    for_each_band(pool, 0, h, rows, [&](size_t, const int rowBegin, const int rowEnd) {
+        convert_rows(frame->data[0], frame->linesize[0], channels, kernel, lut, rowBegin, rowEnd, out);
+    });
+}
+
+namespace {
+
+// Fixed-size slots so the encoder can copy a whole slot and only advance by the sequence length
+struct ColorEscape {
+    std::array<char, 16> bytes;
+    unsigned char size;
+};
+
+constexpr std::array<ColorEscape, 256> make_color_escapes() {
+    std::array<ColorEscape, 256> escapes{};
+    for (int colorIndex = 0; colorIndex < 256; ++colorIndex) {
+        ColorEscape& escape = escapes[colorIndex];
+        size_t n = 0;
+        for (const char c : COLOR_PREFIX) {
+            escape.bytes[n++] = c;
         }
-    } else {
-        std::ranges::transform(resizedImg, asciiArt.begin(), [](const unsigned char pixel) {
-            return pixel_to_ascii(pixel);
-        });
+        if (colorIndex >= 100) {
+            escape.bytes[n++] = static_cast<char>('0' + colorIndex / 100);
+        }
+        if (colorIndex >= 10) {
+            escape.bytes[n++] = static_cast<char>('0' + (colorIndex / 10) % 10);
+        }
+        escape.bytes[n++] = static_cast<char>('0' + colorIndex % 10);
+        escape.bytes[n++] = 'm';
+        escape.size = static_cast<unsigned char>(n);
     }
+    return escapes;
+}
 
-    return asciiArt;
+constexpr std::array<ColorEscape, 256> COLOR_ESCAPES = make_color_escapes();
+
+static_assert(COLOR_ESCAPES[255].size == COLOR_PREFIX.size() + 4);
+
+} // namespace
+
+size_t max_encoded_size(const int w, const int h) {
+    // Longest color escape and the glyph per cell, a newline per row and one reset per frame, plus room for the
+    // last full-slot escape copy
+    constexpr size_t cellSize = COLOR_PREFIX.size() + 3 + 1 + 1;
+    return static_cast<size_t>(w) * h * cellSize + static_cast<size_t>(h) + ANSI_RESET.size() +
+           sizeof(ColorEscape::bytes);
 }
 
-std::vector<ColoredPixel> frame_to_ascii(const AVFrame* frame, const int w, const int h, const int channels) {
-    std::vector<ColoredPixel> asciiArt(static_cast<size_t>(w * h));
+namespace {
+
+// Writes rows [rowBegin, rowEnd), each followed by a newline. SGR state survives newlines, so only color changes
+// need an escape.
+char* write_rows(const CellFrame& asciiArt, const int rowBegin, const int rowEnd, char* dst, size_t& escapes) {
+    const int w = asciiArt.width;
+    int currentColor = -1;
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        const char* glyphs = &asciiArt.glyphs[static_cast<size_t>(y) * w];
+        const unsigned char* colors = &asciiArt.colors[static_cast<size_t>(y) * w];
 
-    for (int y = 0; y < h; ++y) {
         for (int x = 0; x < w; ++x) {
-            const int pixelIndex = y * frame->linesize[0] + x * channels;
-            asciiArt[y * w + x] = pixel_to_ascii(frame->data[0][pixelIndex], frame->data[0][pixelIndex + 1],
-                                                 frame->data[0][pixelIndex + 2]);
+            if (colors[x] != currentColor) {
+                const ColorEscape& escape = COLOR_ESCAPES[colors[x]];
+                std::memcpy(dst, escape.bytes.data(), escape.bytes.size());
+                dst += escape.size;
+                currentColor = colors[x];
+                ++escapes;
+            }
+            *dst++ = glyphs[x];
         }
+        *dst++ = '\n';
     }
+    return dst;
+}
 
-    return asciiArt;
+} // namespace
+
+size_t encode_ascii_frame(const CellFrame& asciiArt, ByteBuffer& out) {
+    const size_t start = out.size();
+    char* const begin = out.extend(max_encoded_size(asciiArt.width, asciiArt.height));
+    size_t escapes = 0;
+    char* dst = write_rows(asciiArt, 0, asciiArt.height, begin, escapes);
+
+    std::memcpy(dst, ANSI_RESET.data(), ANSI_RESET.size());
+    dst += ANSI_RESET.size();
+
+    out.resize(start + static_cast<size_t>(dst - begin));
+    return escapes;
 }
 
-void print_ascii_frame(const std::vector<ColoredPixel>& asciiArt, const int w, const int h) {
-    std::ostringstream oss;
-    oss.str().reserve(w * h * 13);
+namespace {
 
-    thread_local static auto buffer = std::string(w * 13, ' ');
+constexpr size_t decimal_digits(int n) {
+    size_t digits = 1;
+    while (n >= 10) {
+        n /= 10;
+        ++digits;
+    }
+    return digits;
+}
 
-    for (int y = 0; y < h; ++y) {
-        buffer.clear();
-        for (int x = 0; x < w; ++x) {
-            const auto [ascii, colorIndex] = asciiArt[y * w + x];
-            // oss << color_code(colorIndex) << ascii;
-            buffer += color_code(colorIndex);
-            buffer.push_back(ascii);
+char* write_decimal(char* dst, const int n) {
+    return std::to_chars(dst, dst + 16, n).ptr;
+}
+
+// Terminal cursor position in cells, `y` is negative while it is unknown
+struct Cursor {
+    int y;
+    int x;
+};
+
+// CUP, the column is omitted when it is the first one
+size_t absolute_move_size(const int y, const int x) {
+    return 3 + decimal_digits(y + 1) + (x > 0 ? 1 + decimal_digits(x + 1) : 0);
+}
+
+// CUF, the count is omitted when it is 1
+size_t forward_move_size(const int n) {
+    return 3 + (n > 1 ? decimal_digits(n) : 0);
+}
+
+char* write_absolute_move(char* dst, const int y, const int x) {
+    *dst++ = '\033';
+    *dst++ = '[';
+    dst = write_decimal(dst, y + 1);
+    if (x > 0) {
+        *dst++ = ';';
+        dst = write_decimal(dst, x + 1);
+    }
+    *dst++ = 'H';
+    return dst;
+}
+
+char* write_forward_move(char* dst, const int n) {
+    *dst++ = '\033';
+    *dst++ = '[';
+    if (n > 1) {
+        dst = write_decimal(dst, n);
+    }
+    *dst++ = 'C';
+    return dst;
+}
+
+// Emits the shortest of an absolute move, a forward move on the same row, or newlines (which also return to the
+// first column) followed by a forward move
+char* write_cursor_move(char* dst, const Cursor from, const int y, const int x, const int width) {
+    enum class Move { Absolute, Forward, Newlines };
+
+    Move best = Move::Absolute;
+    size_t bestSize = absolute_move_size(y, x);
+
+    // Relative moves are unreliable after writing the last column, where the terminal holds a pending wrap
+    if (from.y == y && from.x < x && from.x < width && forward_move_size(x - from.x) < bestSize) {
+        best = Move::Forward;
+        bestSize = forward_move_size(x - from.x);
+    }
+    if (from.y >= 0 && y > from.y) {
+        const size_t size = static_cast<size_t>(y - from.y) + (x > 0 ? forward_move_size(x) : 0);
+        if (size < bestSize) {
+            best = Move::Newlines;
+        }
+    }
+
+    switch (best) {
+    case Move::Absolute:
+        return write_absolute_move(dst, y, x);
+    case Move::Forward:
+        return write_forward_move(dst, x - from.x);
+    case Move::Newlines:
+        dst = std::fill_n(dst, y - from.y, '\n');
+        return x > 0 ? write_forward_move(dst, x) : dst;
+    }
+    return dst;
+}
+
+size_t escape_size(const int from, const int to) {
+    return from == to ? 0 : COLOR_ESCAPES[to].size;
+}
+
+// Whether rewriting the unchanged cells [begin, end) is cheaper than skipping them with a forward move, including
+// the escape the next changed cell needs in either case
+bool rewrite_gap(const CellFrame& frame, const size_t begin, const size_t end, const int currentColor) {
+    const size_t moveSize = forward_move_size(static_cast<int>(end - begin));
+
+    size_t rewriteSize = 0;
+    int color = currentColor;
+    for (size_t i = begin; i < end; ++i) {
+        rewriteSize += escape_size(color, frame.colors[i]) + 1;
+        color = frame.colors[i];
+        if (rewriteSize > moveSize + COLOR_ESCAPES[255].size) {
+            return false;
         }
-        oss << buffer << ANSI_RESET << '\n';
     }
 
-    std::cout << oss.str();
+    const int nextColor = frame.colors[end];
+    return rewriteSize + escape_size(color, nextColor) <= moveSize + escape_size(currentColor, nextColor);
+}
+
+// Exact size of write_rows for rows [rowBegin, rowEnd) without writing them
+size_t rows_size(const CellFrame& frame, const int rowBegin, const int rowEnd) {
+    const size_t begin = static_cast<size_t>(rowBegin) * frame.width;
+    const size_t end = static_cast<size_t>(rowEnd) * frame.width;
+
+    size_t size = end - begin + static_cast<size_t>(rowEnd - rowBegin);
+    int color = -1;
+    for (size_t i = begin; i < end; ++i) {
+        size += escape_size(color, frame.colors[i]);
+        color = frame.colors[i];
+    }
+    return size;
+}
+
+// Writes the changed cells of rows [rowBegin, rowEnd), moving the cursor over the unchanged ones
+char* write_diff_rows(const CellFrame& shown, const CellFrame& next, const int rowBegin, const int rowEnd, char* dst,
+                      Cursor& cursor, int& currentColor, size_t& escapes) {
+    const int w = next.width;
+
+    const auto changed = [&](const size_t i) {
+        return next.glyphs[i] != shown.glyphs[i] || next.colors[i] != shown.colors[i];
+    };
+    const auto write_cell = [&](const size_t i) {
+        if (next.colors[i] != currentColor) {
+            const ColorEscape& escape = COLOR_ESCAPES[next.colors[i]];
+            std::memcpy(dst, escape.bytes.data(), escape.bytes.size());
+            dst += escape.size;
+            currentColor = next.colors[i];
+            ++escapes;
+        }
+        *dst++ = next.glyphs[i];
+    };
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        const size_t row = static_cast<size_t>(y) * w;
+        int x = 0;
+
+        while (x < w) {
+            while (x < w && !changed(row + x)) {
+                ++x;
+            }
+            if (x == w) {
+                break;
+            }
+
+            dst = write_cursor_move(dst, cursor, y, x, w);
+
+            // Extend the run over short unchanged gaps when rewriting them costs less than moving past them
+            while (x < w) {
+                if (changed(row + x)) {
+                    write_cell(row + x++);
+                    continue;
+                }
+                int gapEnd = x;
+                while (gapEnd < w && !changed(row + gapEnd)) {
+                    ++gapEnd;
+                }
+                if (gapEnd == w || !rewrite_gap(next, row + x, row + gapEnd, currentColor)) {
+                    break;
+                }
+                while (x < gapEnd) {
+                    write_cell(row + x++);
+                }
+            }
+
+            cursor = {.y = y, .x = x};
+        }
+    }
+    return dst;
+}
+
+} // namespace
+
+size_t max_encoded_diff_size(const int w, const int h) {
+    // A cursor move can precede every cell, one more moves below the frame at the end
+    constexpr size_t moveSize = 16;
+    return max_encoded_size(w, h) + static_cast<size_t>(w) * h * moveSize + moveSize;
+}
+
+size_t encode_ascii_diff(const CellFrame& shown, const CellFrame& next, ByteBuffer& out) {
+    const int w = next.width;
+    const int h = next.height;
+
+    const size_t start = out.size();
+    char* const begin = out.extend(max_encoded_diff_size(w, h));
+
+    Cursor cursor{.y = -1, .x = 0};
+    int currentColor = -1;
+    size_t escapes = 0;
+    char* dst = write_diff_rows(shown, next, 0, h, begin, cursor, currentColor, escapes);
+
+    if (cursor.y >= 0) {
+        if (currentColor != -1) {
+            std::memcpy(dst, ANSI_RESET.data(), ANSI_RESET.size());
+            dst += ANSI_RESET.size();
+        }
+        // Park the cursor below the frame like a full redraw does
+        dst = write_cursor_move(dst, cursor, h, 0, w);
+    }
+
+    const size_t diffSize = static_cast<size_t>(dst - begin);
+    out.resize(start + diffSize);
+
+    // A full redraw writes at least every glyph and newline, only count it exactly when the diff gets that large
+    if (diffSize >= next.size() + static_cast<size_t>(h) &&
+        CURSOR_HOME.size() + rows_size(next, 0, h) + ANSI_RESET.size() <= diffSize) {
+        out.resize(start);
+        out.append(CURSOR_HOME);
+        return encode_ascii_frame(next, out);
+    }
+
+    return escapes;
+}
+
+size_t encode_ascii_band(const CellFrame& frame, const int rowBegin, const int rowEnd, ByteBuffer& out) {
+    const size_t start = out.size();
+    char* const begin =
+        out.extend(absolute_move_size(rowBegin, 0) + max_encoded_size(frame.width, rowEnd - rowBegin));
+    size_t escapes = 0;
+    char* dst = write_absolute_move(begin, rowBegin, 0);
+    dst = write_rows(frame, rowBegin, rowEnd, dst, escapes);
+
+    out.resize(start + static_cast<size_t>(dst - begin));
+    return escapes;
+}
+
+size_t encode_ascii_diff_band(const CellFrame& shown, const CellFrame& next, const int rowBegin, const int rowEnd,
+                              ByteBuffer& out) {
+    const int w = next.width;
+    const int rows = rowEnd - rowBegin;
+
+    const size_t start = out.size();
+    char* const begin = out.extend(max_encoded_diff_size(w, rows));
+
+    Cursor cursor{.y = -1, .x = 0};
+    int currentColor = -1;
+    size_t escapes = 0;
+    char* dst = write_diff_rows(shown, next, rowBegin, rowEnd, begin, cursor, currentColor, escapes);
+
+    const size_t diffSize = static_cast<size_t>(dst - begin);
+    out.resize(start + diffSize);
+
+    const size_t cells = static_cast<size_t>(w) * rows;
+    if (diffSize >= cells + static_cast<size_t>(rows) &&
+        absolute_move_size(rowBegin, 0) + rows_size(next, rowBegin, rowEnd) <= diffSize) {
+        out.resize(start);
+        return encode_ascii_band(next, rowBegin, rowEnd, out);
+    }
+
+    return escapes;
+}
+
+bool write_frame(const int fd, const ByteBuffer& buffer) {
+    const char* data = buffer.data();
+    size_t remaining = buffer.size();
+
+    while (remaining > 0) {
+        const ssize_t written = ::write(fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        remaining -= static_cast<size_t>(written);
+    }
+
+    return true;
+}
+
+bool write_frame(const int fd, const std::span<const ByteBuffer> buffers) {
+    constexpr int maxVectors = IOV_MAX < 64 ? IOV_MAX : 64;
+    std::array<iovec, maxVectors> vectors{};
+
+    size_t index = 0;  // First buffer not fully written
+    size_t offset = 0; // Bytes of it already written
+
+    while (true) {
+        int count = 0;
+        for (size_t i = index; i < buffers.size() && count < maxVectors; ++i) {
+            const size_t skip = i == index ? offset : 0;
+            if (buffers[i].size() > skip) {
+                vectors[count++] = {.iov_base = const_cast<char*>(buffers[i].data() + skip),
+                                    .iov_len = buffers[i].size() - skip};
+            }
+        }
+        if (count == 0) {
+            return true;
+        }
+
+        const ssize_t written = ::writev(fd, vectors.data(), count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        auto remaining = static_cast<size_t>(written);
+        while (index < buffers.size() && remaining >= buffers[index].size() - offset) {
+            remaining -= buffers[index].size() - offset;
+            ++index;
+            offset = 0;
+        }
+        offset += remaining;
+    }
+}
+
+void print_ascii_frame(const CellFrame& asciiArt) {
+    thread_local static ByteBuffer buffer;
+
+    buffer.clear();
+    encode_ascii_frame(asciiArt, buffer);
+
+    std::cout.flush();
+    write_frame(STDOUT_FILENO, buffer);
+}
+
+Converter::Converter(const int outputW, const int outputH, const int lutBits, utils::WorkerPool* pool)
+    : outputW_(outputW), outputH_(outputH), kernel_(rgb_row_kernel(detect_simd_level())), pool_(pool) {
+    if (lutBits != 0) {
+        lut_.emplace(lutBits);
+    }
+}
+
+size_t Converter::threads() const {
+    return pool_threads(pool_);
+}
+
+bool Converter::convert(const AVFrame& frame, CellFrame& out) const {
+    return convert(frame, 0, outputH_, out);
+}
+
+bool Converter::convert(const AVFrame& frame, const int rowBegin, const int rowEnd, CellFrame& out) const {
+    out.resize(outputW_, outputH_);
+
+    size_t rowBytes = static_cast<size_t>(outputW_) * 2;
+    for (int plane = 0; plane < AV_NUM_DATA_POINTERS && frame.data[plane] != nullptr; ++plane) {
+        rowBytes += static_cast<size_t>(std::abs(frame.linesize[plane]));
+    }
+
+    std::atomic<bool> converted{true};
+    for_each_band(pool_, rowBegin, rowEnd, band_rows(rowBytes, rowEnd - rowBegin, threads()),
+                  [&](size_t, const int bandBegin, const int bandEnd) {
+                      if (!convert_rows(frame, bandBegin, bandEnd, out)) {
+                          converted.store(false, std::memory_order_relaxed);
+                      }
+                  });
+    return converted.load(std::memory_order_relaxed);
+}
+
+bool Converter::convert_rows(const AVFrame& frame, const int rowBegin, const int rowEnd, CellFrame& out) const {
+    int chromaShift = 0; // Horizontal and vertical
+    int chromaStep = 1;
+    AVColorRange range = frame.color_range;
+
+    switch (frame.format) {
+    case AV_PIX_FMT_RGB24:
+        AsciiArt::convert_rows(frame.data[0], frame.linesize[0], 3, kernel_, lut_ ? &*lut_ : nullptr, rowBegin, rowEnd,
+                               out);
+        return true;
+    case AV_PIX_FMT_GRAY8:
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            const size_t offset = static_cast<size_t>(y) * outputW_;
+            luma_row_to_ascii(yuv_matrix(AVCOL_SPC_UNSPECIFIED, AVCOL_RANGE_JPEG),
+                              frame.data[0] + y * frame.linesize[0], outputW_, &out.glyphs[offset],
+                              &out.colors[offset]);
+        }
+        return true;
+    case AV_PIX_FMT_YUVJ420P:
+        range = AVCOL_RANGE_JPEG;
+        [[fallthrough]];
+    case AV_PIX_FMT_YUV420P:
+        chromaShift = 1;
+        break;
+    case AV_PIX_FMT_NV12:
+        chromaShift = 1;
+        chromaStep = 2;
+        break;
+    case AV_PIX_FMT_YUVJ444P:
+        range = AVCOL_RANGE_JPEG;
+        break;
+    case AV_PIX_FMT_YUV444P:
+        break;
+    default:
+        return false;
+    }
+
+    const YuvMatrix matrix = yuv_matrix(frame.colorspace, range);
+    // NV12 interleaves U and V in the second plane
+    const unsigned char* uPlane = frame.data[1];
+    const unsigned char* vPlane = chromaStep == 2 ? frame.data[1] + 1 : frame.data[2];
+    const int vLinesize = chromaStep == 2 ? frame.linesize[1] : frame.linesize[2];
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        const int chromaY = y >> chromaShift;
+        const size_t offset = static_cast<size_t>(y) * outputW_;
+        yuv_row_to_ascii(matrix, frame.data[0] + y * frame.linesize[0], uPlane + chromaY * frame.linesize[1],
+                         vPlane + chromaY * vLinesize, outputW_, chromaShift, chromaStep, &out.glyphs[offset],
+                         &out.colors[offset]);
+    }
+    return true;
+}
+
+bool Converter::supports_area(const int format) {
+    switch (format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool Converter::convert_area(const AVFrame& frame, const bool mono, CellFrame& out) {
+    if (!supports_area(frame.format)) {
+        return false;
+    }
+
+    const bool subsampled = frame.format != AV_PIX_FMT_YUV444P && frame.format != AV_PIX_FMT_YUVJ444P;
+    const bool interleaved = frame.format == AV_PIX_FMT_NV12;
+    const bool fullRange = frame.format == AV_PIX_FMT_YUVJ420P || frame.format == AV_PIX_FMT_YUVJ444P;
+    const YuvMatrix matrix = yuv_matrix(frame.colorspace, fullRange ? AVCOL_RANGE_JPEG : frame.color_range);
+
+    const int chromaW = subsampled ? (frame.width + 1) >> 1 : frame.width;
+    const int chromaH = subsampled ? (frame.height + 1) >> 1 : frame.height;
+    const int chromaChannels = interleaved ? 2 : 1;
+
+    size_t rowBytes = area_row_bytes(frame.linesize[0], frame.height, outputH_, outputW_);
+    if (!mono) {
+        rowBytes += area_row_bytes(static_cast<ptrdiff_t>(frame.linesize[1]) * 2, chromaH, outputH_, 0);
+    }
+    const int rows = band_rows(rowBytes, outputH_, threads());
+    const std::span<AreaBand> bands = area_bands(band_count(0, outputH_, rows), frame.width, frame.height, 1, chromaW,
+                                                 chromaH, mono ? 0 : chromaChannels);
+
+    out.resize(outputW_, outputH_);
+    for_each_band(pool_, 0, outputH_, rows, [&](const size_t band, const int rowBegin, const int rowEnd) {
+        AreaBand& scratch = bands[band];
+        // Luma row, then U and V or interleaved UV
+        unsigned char* luma = scratch.row.data();
+        unsigned char* chroma = luma + outputW_;
+
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            const size_t offset = static_cast<size_t>(y) * outputW_;
+            scratch.luma.scale_row(frame.data[0], frame.linesize[0], y, luma);
+
+            if (mono) {
+                luma_row_to_ascii(matrix, luma, outputW_, &out.glyphs[offset], &out.colors[offset]);
+            } else if (interleaved) {
+                scratch.chroma.scale_row(frame.data[1], frame.linesize[1], y, chroma);
+                yuv_row_to_ascii(matrix, luma, chroma, chroma + 1, outputW_, 0, 2, &out.glyphs[offset],
+                                 &out.colors[offset]);
+            } else {
+                scratch.chroma.scale_row(frame.data[1], frame.linesize[1], y, chroma);
+                scratch.chroma.scale_row(frame.data[2], frame.linesize[2], y, chroma + outputW_);
+                yuv_row_to_ascii(matrix, luma, chroma, chroma + outputW_, outputW_, 0, 1, &out.glyphs[offset],
+                                 &out.colors[offset]);
+            }
+        }
+    });
+    return true;
+}
+
+std::span<Converter::AreaBand> Converter::area_bands(const size_t count, const int srcW, const int srcH,
+                                                     const int channels, const int chromaW, const int chromaH,
+                                                     const int chromaChannels) {
+    areaBands_.resize(count);
+    for (AreaBand& band : areaBands_) {
+        if (!band.luma.matches(srcW, srcH, channels)) {
+            band.luma = AreaScaler(srcW, srcH, outputW_, outputH_, channels);
+        }
+        if (chromaChannels > 0 && !band.chroma.matches(chromaW, chromaH, chromaChannels)) {
+            band.chroma = AreaScaler(chromaW, chromaH, outputW_, outputH_, chromaChannels);
+        }
+        band.row.resize(static_cast<size_t>(outputW_) * std::max(channels, 3));
+    }
+    return areaBands_;
+}
+
+void Converter::convert(const unsigned char* image, const int w, const int h, const int channels, CellFrame& out) {
+    out.resize(outputW_, outputH_);
+
+    const ColorLut* lut = lut_ ? &*lut_ : nullptr;
+    const auto stride = static_cast<ptrdiff_t>(w) * channels;
+
+    if (w >= outputW_ && h >= outputH_) {
+        const int rows = band_rows(area_row_bytes(stride, h, outputH_, outputW_), outputH_, threads());
+        const std::span<AreaBand> bands = area_bands(band_count(0, outputH_, rows), w, h, channels, 0, 0, 0);
+        for_each_band(pool_, 0, outputH_, rows, [&](const size_t band, const int rowBegin, const int rowEnd) {
+            convert_area_rows(image, channels, bands[band].luma, bands[band].row, kernel_, lut, stride, rowBegin,
+                              rowEnd, out);
+        });
+        return;
+    }
+
+    const auto resizedStride = static_cast<ptrdiff_t>(outputW_) * channels;
+    scratch_.resize(static_cast<size_t>(outputW_) * outputH_ * channels);
+    stbir_resize_uint8_linear(image, w, h, 0, scratch_.data(), outputW_, outputH_, 0,
+                              static_cast<stbir_pixel_layout>(channels));
+    const int rows = band_rows(static_cast<size_t>(resizedStride) + static_cast<size_t>(outputW_) * 2, outputH_,
+                               threads());
+    for_each_band(pool_, 0, outputH_, rows, [&](size_t, const int rowBegin, const int rowEnd) {
+        AsciiArt::convert_rows(scratch_.data(), resizedStride, channels, kernel_, lut, rowBegin, rowEnd, out);
+    });
+}
+
+size_t Converter::encode(const CellFrame& frame, ByteBuffer& out) const {
+    out.clear();
+    out.append(CURSOR_HOME);
+    return encode_ascii_frame(frame, out);
+}
+
+size_t Converter::encode_diff(const CellFrame& shown, const CellFrame& frame, ByteBuffer& out) const {
+    if (shown.width != frame.width || shown.height != frame.height) {
+        return encode(frame, out);
+    }
+    out.clear();
+    return encode_ascii_diff(shown, frame, out);
+}
+
+size_t Converter::encode(const CellFrame& frame, std::vector<ByteBuffer>& bands) const {
+    const int rows = band_rows(max_encoded_size(frame.width, 1), frame.height, threads());
+    const size_t count = band_count(0, frame.height, rows);
+    bands.resize(count + 1);
+
+    std::atomic<size_t> escapes{0};
+    for_each_band(pool_, 0, frame.height, rows, [&](const size_t band, const int rowBegin, const int rowEnd) {
+        bands[band].clear();
+        escapes.fetch_add(encode_ascii_band(frame, rowBegin, rowEnd, bands[band]), std::memory_order_relaxed);
+    });
+
+    bands[count].clear();
+    bands[count].append(ANSI_RESET);
+    return escapes.load(std::memory_order_relaxed);
+}
+
+size_t Converter::encode_diff(const CellFrame& shown, const CellFrame& frame, std::vector<ByteBuffer>& bands) const {
+    if (shown.width != frame.width || shown.height != frame.height) {
+        return encode(frame, bands);
+    }
+
+    const int rows = band_rows(max_encoded_size(frame.width, 1), frame.height, threads());
+    const size_t count = band_count(0, frame.height, rows);
+    bands.resize(count + 1);
+
+    std::atomic<size_t> escapes{0};
+    for_each_band(pool_, 0, frame.height, rows, [&](const size_t band, const int rowBegin, const int rowEnd) {
+        bands[band].clear();
+        escapes.fetch_add(encode_ascii_diff_band(shown, frame, rowBegin, rowEnd, bands[band]),
+                          std::memory_order_relaxed);
+    });
+
+    // Reset and park the cursor below the frame, unless nothing changed
+    ByteBuffer& tail = bands[count];
+    tail.clear();
+    if (std::any_of(bands.begin(), bands.begin() + static_cast<ptrdiff_t>(count),
+                    [](const ByteBuffer& band) { return band.size() > 0; })) {
+        tail.append(ANSI_RESET);
+        char* const begin = tail.extend(absolute_move_size(frame.height, 0));
+        write_absolute_move(begin, frame.height, 0);
+    }
+    return escapes.load(std::memory_order_relaxed);
 }
 
 } // namespace AsciiArt
@@ -0,0 +1,279 @@
+#include "ascii_lib.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ASCII_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace AsciiArt {
+
+#ifdef ASCII_SIMD_X86
+
+static_assert(ASCII_CHARS.length() <= 32, "glyph lookup uses two 16-byte shuffle tables");
+
+namespace {
+
+using ShuffleMask = std::array<std::int8_t, 16>;
+
+// pshufb mask gathering channel `channel` of 16 packed RGB24 pixels from the `block`-th 16-byte load
+constexpr ShuffleMask deinterleave_mask(const int channel, const int block) {
+    ShuffleMask mask{};
+    for (int i = 0; i < 16; ++i) {
+        const int src = i * 3 + channel - block * 16;
+        mask[i] = (src >= 0 && src < 16) ? static_cast<std::int8_t>(src) : static_cast<std::int8_t>(-128);
+    }
+    return mask;
+}
+
+constexpr std::array<std::array<ShuffleMask, 3>, 3> DEINTERLEAVE = {{
+    {deinterleave_mask(0, 0), deinterleave_mask(0, 1), deinterleave_mask(0, 2)},
+    {deinterleave_mask(1, 0), deinterleave_mask(1, 1), deinterleave_mask(1, 2)},
+    {deinterleave_mask(2, 0), deinterleave_mask(2, 1), deinterleave_mask(2, 2)},
+}};
+
+constexpr std::array<char, 32> glyph_table() {
+    std::array<char, 32> table{};
+    for (size_t i = 0; i < table.size(); ++i) {
+        table[i] = ASCII_CHARS[std::min(i, ASCII_CHARS.length() - 1)];
+    }
+    return table;
+}
+
+constexpr std::array<char, 32> GLYPHS = glyph_table();
+
+__attribute__((target("sse4.1"))) inline __m128i load_mask(const ShuffleMask& mask) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask.data()));
+}
+
+__attribute__((target("sse4.1"))) inline __m128i gather_channel(const __m128i v0, const __m128i v1, const __m128i v2,
+                                                                const int channel) {
+    const auto& masks = DEINTERLEAVE[channel];
+    return _mm_or_si128(
+        _mm_or_si128(_mm_shuffle_epi8(v0, load_mask(masks[0])), _mm_shuffle_epi8(v1, load_mask(masks[1]))),
+        _mm_shuffle_epi8(v2, load_mask(masks[2])));
+}
+
+// 8 pixels of 16-bit channels -> 16-bit luma and glyph index / color index
+__attribute__((target("sse4.1"))) inline __m128i glyph_index_epi16(const __m128i r, const __m128i g,
+                                                                   const __m128i b) {
+    const __m128i luma = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(LUMA_R)),
+                                                     _mm_mullo_epi16(g, _mm_set1_epi16(LUMA_G))),
+                                       _mm_mullo_epi16(b, _mm_set1_epi16(LUMA_B)));
+    return _mm_mulhi_epu16(luma, _mm_set1_epi16(static_cast<short>(ASCII_CHARS.length())));
+}
+
+__attribute__((target("sse4.1"))) inline __m128i cube_index_epi16(const __m128i r, const __m128i g, const __m128i b) {
+    const __m128i div = _mm_set1_epi16(CUBE_DIV_MUL);
+    const __m128i qr = _mm_mulhi_epu16(r, div);
+    const __m128i qg = _mm_mulhi_epu16(g, div);
+    const __m128i qb = _mm_mulhi_epu16(b, div);
+    return _mm_add_epi16(_mm_add_epi16(_mm_set1_epi16(16), _mm_mullo_epi16(qr, _mm_set1_epi16(36))),
+                         _mm_add_epi16(_mm_mullo_epi16(qg, _mm_set1_epi16(6)), qb));
+}
+
+// Maps glyph indices in [0, 32) to characters with two in-register tables
+__attribute__((target("sse4.1"))) inline __m128i lookup_glyph(const __m128i index) {
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(GLYPHS.data()));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(GLYPHS.data() + 16));
+    const __m128i useHi = _mm_cmpgt_epi8(index, _mm_set1_epi8(15));
+    return _mm_blendv_epi8(_mm_shuffle_epi8(lo, index), _mm_shuffle_epi8(hi, index), useHi);
+}
+
+__attribute__((target("sse4.1"))) void rgb_row_to_ascii_sse41(const unsigned char* rgb, const int count,
+                                                              char* glyphs, unsigned char* colors) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const unsigned char* src = rgb + static_cast<ptrdiff_t>(i) * 3;
+        const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+
+        const __m128i r8 = gather_channel(v0, v1, v2, 0);
+        const __m128i g8 = gather_channel(v0, v1, v2, 1);
+        const __m128i b8 = gather_channel(v0, v1, v2, 2);
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i rLo = _mm_cvtepu8_epi16(r8);
+        const __m128i gLo = _mm_cvtepu8_epi16(g8);
+        const __m128i bLo = _mm_cvtepu8_epi16(b8);
+        const __m128i rHi = _mm_unpackhi_epi8(r8, zero);
+        const __m128i gHi = _mm_unpackhi_epi8(g8, zero);
+        const __m128i bHi = _mm_unpackhi_epi8(b8, zero);
+
+        const __m128i glyphIndex =
+            _mm_packus_epi16(glyph_index_epi16(rLo, gLo, bLo), glyph_index_epi16(rHi, gHi, bHi));
+        const __m128i colorIndex =
+            _mm_packus_epi16(cube_index_epi16(rLo, gLo, bLo), cube_index_epi16(rHi, gHi, bHi));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(glyphs + i), lookup_glyph(glyphIndex));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + i), colorIndex);
+    }
+    rgb_row_to_ascii_scalar(rgb + static_cast<ptrdiff_t>(i) * 3, count - i, glyphs + i, colors + i);
+}
+
+__attribute__((target("avx2"))) inline __m256i broadcast_mask(const ShuffleMask& mask) {
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(mask.data())));
+}
+
+__attribute__((target("avx2"))) inline __m256i gather_channel(const __m256i v0, const __m256i v1, const __m256i v2,
+                                                              const int channel) {
+    const auto& masks = DEINTERLEAVE[channel];
+    return _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, broadcast_mask(masks[0])),
+                                           _mm256_shuffle_epi8(v1, broadcast_mask(masks[1]))),
+                           _mm256_shuffle_epi8(v2, broadcast_mask(masks[2])));
+}
+
+__attribute__((target("avx2"))) inline __m256i glyph_index_epi16(const __m256i r, const __m256i g, const __m256i b) {
+    const __m256i luma = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(LUMA_R)),
+                                                           _mm256_mullo_epi16(g, _mm256_set1_epi16(LUMA_G))),
+                                          _mm256_mullo_epi16(b, _mm256_set1_epi16(LUMA_B)));
+    return _mm256_mulhi_epu16(luma, _mm256_set1_epi16(static_cast<short>(ASCII_CHARS.length())));
+}
+
+__attribute__((target("avx2"))) inline __m256i cube_index_epi16(const __m256i r, const __m256i g, const __m256i b) {
+    const __m256i div = _mm256_set1_epi16(CUBE_DIV_MUL);
+    const __m256i qr = _mm256_mulhi_epu16(r, div);
+    const __m256i qg = _mm256_mulhi_epu16(g, div);
+    const __m256i qb = _mm256_mulhi_epu16(b, div);
+    return _mm256_add_epi16(_mm256_add_epi16(_mm256_set1_epi16(16), _mm256_mullo_epi16(qr, _mm256_set1_epi16(36))),
+                            _mm256_add_epi16(_mm256_mullo_epi16(qg, _mm256_set1_epi16(6)), qb));
+}
+
+__attribute__((target("avx2"))) inline __m256i lookup_glyph(const __m256i index) {
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(GLYPHS.data())));
+    const __m256i hi =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(GLYPHS.data() + 16)));
+    const __m256i useHi = _mm256_cmpgt_epi8(index, _mm256_set1_epi8(15));
+    return _mm256_blendv_epi8(_mm256_shuffle_epi8(lo, index), _mm256_shuffle_epi8(hi, index), useHi);
+}
+
+// packus works per 128-bit lane, restore pixel order afterwards
+__attribute__((target("avx2"))) inline __m256i pack_epi16(const __m256i lo, const __m256i hi) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+}
+
+__attribute__((target("avx2"))) inline __m256i load_blocks(const unsigned char* src, const int block) {
+    return _mm256_loadu2_m128i(reinterpret_cast<const __m128i*>(src + 48 + block * 16),
+                               reinterpret_cast<const __m128i*>(src + block * 16));
+}
+
+__attribute__((target("avx2"))) void rgb_row_to_ascii_avx2(const unsigned char* rgb, const int count, char* glyphs,
+                                                           unsigned char* colors) {
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        // Lane 0 holds pixels [0, 16), lane 1 holds pixels [16, 32)
+        const unsigned char* src = rgb + static_cast<ptrdiff_t>(i) * 3;
+        const __m256i v0 = load_blocks(src, 0);
+        const __m256i v1 = load_blocks(src, 1);
+        const __m256i v2 = load_blocks(src, 2);
+
+        const __m256i r8 = gather_channel(v0, v1, v2, 0);
+        const __m256i g8 = gather_channel(v0, v1, v2, 1);
+        const __m256i b8 = gather_channel(v0, v1, v2, 2);
+
+        const __m256i rLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(r8));
+        const __m256i gLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(g8));
+        const __m256i bLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b8));
+        const __m256i rHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(r8, 1));
+        const __m256i gHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(g8, 1));
+        const __m256i bHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b8, 1));
+
+        const __m256i glyphIndex = pack_epi16(glyph_index_epi16(rLo, gLo, bLo), glyph_index_epi16(rHi, gHi, bHi));
+        const __m256i colorIndex = pack_epi16(cube_index_epi16(rLo, gLo, bLo), cube_index_epi16(rHi, gHi, bHi));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(glyphs + i), lookup_glyph(glyphIndex));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(colors + i), colorIndex);
+    }
+    rgb_row_to_ascii_sse41(rgb + static_cast<ptrdiff_t>(i) * 3, count - i, glyphs + i, colors + i);
+}
+
+__attribute__((target("sse4.1"))) void accumulate_row_sse41(const unsigned char* row, const int count,
+                                                            std::uint16_t* sums) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        auto* lo = reinterpret_cast<__m128i*>(sums + i);
+        auto* hi = reinterpret_cast<__m128i*>(sums + i + 8);
+        _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_cvtepu8_epi16(bytes)));
+        _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(bytes, _mm_setzero_si128())));
+    }
+    accumulate_row_scalar(row + i, count - i, sums + i);
+}
+
+__attribute__((target("avx2"))) void accumulate_row_avx2(const unsigned char* row, const int count,
+                                                         std::uint16_t* sums) {
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        auto* lo = reinterpret_cast<__m256i*>(sums + i);
+        auto* hi = reinterpret_cast<__m256i*>(sums + i + 16);
+        _mm256_storeu_si256(
+            lo, _mm256_add_epi16(_mm256_loadu_si256(lo), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes))));
+        _mm256_storeu_si256(
+            hi, _mm256_add_epi16(_mm256_loadu_si256(hi), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1))));
+    }
+    accumulate_row_sse41(row + i, count - i, sums + i);
+}
+
+} // namespace
+
+SimdLevel detect_simd_level() {
+    static const SimdLevel level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return SimdLevel::AVX2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return SimdLevel::SSE41;
+        }
+        return SimdLevel::Scalar;
+    }();
+    return level;
+}
+
+RgbRowKernel rgb_row_kernel(const SimdLevel level) {
+    switch (level) {
+    case SimdLevel::AVX2:
+        return detect_simd_level() == SimdLevel::AVX2 ? rgb_row_to_ascii_avx2 : rgb_row_kernel(SimdLevel::SSE41);
+    case SimdLevel::SSE41:
+        return detect_simd_level() != SimdLevel::Scalar ? rgb_row_to_ascii_sse41 : rgb_row_to_ascii_scalar;
+    case SimdLevel::Scalar:
+        break;
+    }
+    return rgb_row_to_ascii_scalar;
+}
+
+AccumulateRowKernel accumulate_row_kernel(const SimdLevel level) {
+    switch (level) {
+    case SimdLevel::AVX2:
+        return detect_simd_level() == SimdLevel::AVX2 ? accumulate_row_avx2 : accumulate_row_kernel(SimdLevel::SSE41);
+    case SimdLevel::SSE41:
+        return detect_simd_level() != SimdLevel::Scalar ? accumulate_row_sse41 : accumulate_row_scalar;
+    case SimdLevel::Scalar:
+        break;
+    }
+    return accumulate_row_scalar;
+}
+
+#else
+
+SimdLevel detect_simd_level() {
+    return SimdLevel::Scalar;
+}
+
+RgbRowKernel rgb_row_kernel(const SimdLevel /*level*/) {
+    return rgb_row_to_ascii_scalar;
+}
+
+AccumulateRowKernel accumulate_row_kernel(const SimdLevel /*level*/) {
+    return accumulate_row_scalar;
+}
+
+#endif // ASCII_SIMD_X86
+
+} // namespace AsciiArt
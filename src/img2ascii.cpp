@@ -1,16 +1,33 @@
 #include "ascii_lib.hpp"
+#include "worker_pool.hpp"
 
+#include <algorithm>
+#include <charconv>
 #include <filesystem>
+#include <string_view>
+#include <thread>
 
 static constexpr int OUTPUT_WIDTH = 600;
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " FILE" << '\n';
+    // Threads converting row bands, every core by default
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
+    int arg = 1;
+    if (argc == 4 && std::string_view(argv[1]) == "--threads") {
+        const std::string_view threads_str = argv[2];
+        if (std::from_chars(threads_str.data(), threads_str.data() + threads_str.size(), threads).ec != std::errc() ||
+            threads == 0) {
+            std::cerr << "Invalid threads value: " << threads_str << '\n';
+            return 1;
+        }
+        arg = 3;
+    }
+    if (argc != arg + 1) {
+        std::cerr << "Usage: " << argv[0] << " [--threads n] FILE" << '\n';
         return 1;
     }
 
-    const std::filesystem::path image_path(argv[1]);
+    const std::filesystem::path image_path(argv[arg]);
 
     if (!std::filesystem::exists(image_path)) {
         std::cerr << "File not found: " << image_path << '\n';
@@ -28,9 +45,11 @@ int main(int argc, char** argv) {
     const double aspect_ratio = static_cast<double>(height) / width;
     const int output_height = static_cast<int>(OUTPUT_WIDTH * aspect_ratio * 0.45);
 
-    const auto ascii_art = AsciiArt::image_to_ascii(img, width, height, channels, OUTPUT_WIDTH, output_height);
+    utils::WorkerPool pool(threads);
+    const auto ascii_art =
+        AsciiArt::image_to_ascii(img, width, height, channels, OUTPUT_WIDTH, output_height, nullptr, &pool);
 
-    print_ascii_frame(ascii_art, OUTPUT_WIDTH, output_height);
+    print_ascii_frame(ascii_art);
 
     stbi_image_free(img);
 
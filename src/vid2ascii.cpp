@@ -1,19 +1,970 @@
 #include "ascii_lib.hpp"
 #include "cmdline.hpp"
+#include "frame_timeline.hpp"
+#include "latency_histogram.hpp"
+#include "reorder_buffer.hpp"
+#include "spsc_queue.hpp"
+#include "tracer.hpp"
+#include "worker_pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <csignal>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 constexpr int OUTPUT_WIDTH = 600;
-constexpr double MIN_FPS = 1.0; // Guaranteed minimum fps
+constexpr double MIN_FPS = 1.0;           // Guaranteed minimum fps
+constexpr std::size_t PIPELINE_DEPTH = 4; // Frames in flight between two stages
+constexpr int SCALE_BANDS = 4;            // Row bands a frame is scaled and handed to the converter in
+constexpr std::size_t TRACE_SPANS = 1 << 18; // Per thread, minutes of playback
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Nanoseconds = std::chrono::nanoseconds;
+
+// Frames presented later than this after their deadline count as late
+constexpr Nanoseconds LATE_TOLERANCE = std::chrono::milliseconds(2);
+// Timestamp rounding tolerated when capping the frame rate
+constexpr Nanoseconds FRAME_JITTER = std::chrono::milliseconds(1);
+// Longest time the screen may go without a new frame, unless packets were skipped in between
+constexpr Nanoseconds MAX_FRAME_GAP =
+    std::chrono::duration_cast<Nanoseconds>(std::chrono::duration<double>(1.0 / MIN_FPS));
+
+// Reference counted buffers for scaled frames. A frame takes one when scaling starts and the convert stage hands it
+// back by unreferencing the frame, so buffers travel between stages without copies and, once the pool holds as many
+// as are in flight, without allocations.
+class FramePool {
+public:
+    FramePool(const AVPixelFormat format, const int width, const int height, const AVColorSpace colorspace,
+              const AVColorRange color_range)
+        : format_(format), width_(width), height_(height), colorspace_(colorspace), color_range_(color_range),
+          pool_(av_buffer_pool_init(static_cast<std::size_t>(av_image_get_buffer_size(format, width, height, ALIGN)),
+                                    av_buffer_alloc)) {}
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Buffers still referenced are freed once their frames let go of them
+    ~FramePool() {
+        av_buffer_pool_uninit(&pool_);
+    }
+
+    [[nodiscard]] bool valid() const {
+        return pool_ != nullptr;
+    }
+
+    [[nodiscard]] int height() const {
+        return height_;
+    }
+
+    // Points an unreferenced frame at a pooled buffer
+    bool get(AVFrame& frame) const {
+        frame.buf[0] = av_buffer_pool_get(pool_);
+        if (frame.buf[0] == nullptr) {
+            return false;
+        }
+        av_image_fill_arrays(frame.data, frame.linesize, frame.buf[0]->data, format_, width_, height_, ALIGN);
+        frame.format = format_;
+        frame.width = width_;
+        frame.height = height_;
+        frame.colorspace = colorspace_;
+        frame.color_range = color_range_;
+        return true;
+    }
+
+private:
+    static constexpr int ALIGN = 64; // Row alignment, enough for any SIMD swscale uses
+
+    AVPixelFormat format_;
+    int width_;
+    int height_;
+    AVColorSpace colorspace_;
+    AVColorRange color_range_;
+    AVBufferPool* pool_;
+};
+
+struct Decoder {
+    AVFormatContext* format_context;
+    AVCodecContext* codec_context;
+    SwsContext* sws_context;
+    const FramePool* frames; // Scaled frame buffers, nullptr when decoded frames are converted directly
+    int video_stream_index;
+    bool slices; // Scale rows handed over by draw_horiz_band while the rest of the picture decodes
+};
+
+struct Timing {
+    AVRational time_base;      // Of the video stream
+    Nanoseconds frame_interval; // Nominal, used when a frame has no timestamp
+    Nanoseconds min_interval;   // Between two presented frames, from --max-fps
+};
+
+// Maps presentation times to steady clock deadlines. The origin is fixed when the first frame is presented, so
+// frames are never considered late while the pipeline is still filling up.
+class PresentationClock {
+public:
+    [[nodiscard]] bool started() const {
+        return origin_.load(std::memory_order_acquire) != 0;
+    }
+
+    void start(const Clock::time_point now, const Nanoseconds pts) {
+        origin_.store((now - pts).time_since_epoch().count(), std::memory_order_release);
+    }
+
+    [[nodiscard]] Clock::time_point deadline(const Nanoseconds pts) const {
+        return Clock::time_point(Clock::duration(origin_.load(std::memory_order_acquire))) + pts;
+    }
+
+private:
+    std::atomic<Clock::rep> origin_{0};
+};
+
+// Frame at output size in the scaled format, or a reference to a decoded frame when area averaging. It is published
+// as soon as scaling starts and its rows become readable band by band. Its buffers are only referenced while the
+// frame is in flight.
+struct ScaledFrame {
+    AVFrame* image = nullptr;
+    Nanoseconds pts{0};
+    std::uint64_t number = 0; // Frames presented before it, for tracing
+    Clock::time_point sent;   // Of the packet that completed the frame, for latency
+    std::atomic<int> rows{0}; // Scaled so far
+
+    void publish_rows(const int count) {
+        rows.store(count, std::memory_order_release);
+        rows.notify_one();
+    }
+
+    // Blocks until more than `row` rows are scaled, returns how many are
+    int wait_rows(const int row) const {
+        int ready = rows.load(std::memory_order_acquire);
+        while (ready <= row) {
+            rows.wait(ready, std::memory_order_acquire);
+            ready = rows.load(std::memory_order_acquire);
+        }
+        return ready;
+    }
+};
+
+struct EncodedFrame {
+    std::vector<AsciiArt::ByteBuffer> bands; // Encoded in parallel, written with one writev
+    std::size_t escapes = 0;
+    Nanoseconds pts{0};
+    std::uint64_t number = 0;
+    Clock::time_point sent;
+};
+
+// Shared by the decode, convert and output threads
+struct Pipeline {
+    Pipeline(const std::span<ScaledFrame> scaled_frames, const std::span<EncodedFrame> encoded_frames)
+        : scaled(scaled_frames), encoded(encoded_frames) {}
+
+    utils::SpscRing<ScaledFrame> scaled;
+    utils::SpscRing<EncodedFrame> encoded;
+    PresentationClock clock;
+    // Set by a failing stage; the stages upstream of it stop producing and those downstream drain and close
+    std::atomic<bool> stop{false};
+};
+
+struct DecodeStats {
+    std::uint64_t skipped = 0; // Packets never sent to the decoder
+    std::uint64_t decoded = 0;
+    std::uint64_t dropped = 0; // Already late when decoded
+    Nanoseconds decode_time{0};
+    utils::LatencyHistogram demux;  // Per packet read
+    utils::LatencyHistogram decode; // Per packet sent, scaling left out
+    utils::LatencyHistogram scale;  // Per scaled frame
+};
+
+struct ConvertStats {
+    utils::LatencyHistogram convert; // Per frame, including waits for rows still being scaled
+    utils::LatencyHistogram encode;
+};
+
+enum class ThreadType { Auto, Frame, Slice };
+
+enum class SkipMode { None, NonRef, NonKey };
+
+// Frames the decoder may discard. Never chosen automatically: how many frames are non-reference depends on the
+// encoder's GOP structure, so skipping them can leave fewer frames than --max-fps asks for.
+AVDiscard skip_frame_discard(const SkipMode mode) {
+    switch (mode) {
+    case SkipMode::None:
+        return AVDISCARD_DEFAULT;
+    case SkipMode::NonRef:
+        return AVDISCARD_NONREF;
+    case SkipMode::NonKey:
+        return AVDISCARD_NONKEY;
+    }
+    return AVDISCARD_DEFAULT;
+}
+
+// Whether a packet can produce a frame under the decoder's skip_frame setting. Packets it would discard are dropped
+// before avcodec_send_packet, saving the copy and the parsing. Non-reference packets are only recognised when the
+// demuxer sets AV_PKT_FLAG_DISPOSABLE, most do not and leave those frames for the decoder to discard.
+bool should_decode(const AVPacket& packet, const AVDiscard discard) {
+    if (discard >= AVDISCARD_NONKEY) {
+        return (packet.flags & AV_PKT_FLAG_KEY) != 0;
+    }
+    if (discard >= AVDISCARD_NONREF) {
+        return (packet.flags & AV_PKT_FLAG_DISPOSABLE) == 0;
+    }
+    return true;
+}
+
+// Decoder and scaler threads when left to auto: about one per half megapixel of source, leaving two cores to the
+// convert and output stages
+int auto_thread_count(const int width, const int height) {
+    constexpr int PIXELS_PER_THREAD = 500'000;
+    constexpr int MAX_THREADS = 16;
+    const int cores = static_cast<int>(std::max(1U, std::thread::hardware_concurrency()));
+    const int by_resolution = (width * height + PIXELS_PER_THREAD - 1) / PIXELS_PER_THREAD;
+    return std::clamp(std::min(by_resolution, cores - 2), 1, MAX_THREADS);
+}
+
+std::string_view thread_type_name(const int thread_type) {
+    if ((thread_type & FF_THREAD_FRAME) != 0) {
+        return "frame";
+    }
+    if ((thread_type & FF_THREAD_SLICE) != 0) {
+        return "slice";
+    }
+    return "none";
+}
+
+// Pixel format decoded frames are scaled to. YUV layouts the converter reads are kept so that swscale only resamples
+// the planes, other sources go to YUV420P. Mono scales the luma plane alone and the lookup table needs RGB.
+AVPixelFormat scaled_format(const AVPixelFormat source, const bool mono, const bool rgb) {
+    if (mono) {
+        return AV_PIX_FMT_GRAY8;
+    }
+    if (rgb) {
+        return AV_PIX_FMT_RGB24;
+    }
+    switch (source) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+        return source;
+    default:
+        return AV_PIX_FMT_YUV420P;
+    }
+}
+
+// Scaler splitting every frame across `threads` slice threads. Before libswscale 6 the option does not exist and
+// frames are scaled on the calling thread.
+SwsContext* create_scaler(const AVCodecContext& source, const int width, const int height,
+                          const AVPixelFormat format, const int threads) {
+    SwsContext* sws_context = sws_alloc_context();
+    if (sws_context == nullptr) {
+        return nullptr;
+    }
+
+    av_opt_set_int(sws_context, "srcw", source.width, 0);
+    av_opt_set_int(sws_context, "srch", source.height, 0);
+    av_opt_set_int(sws_context, "src_format", source.pix_fmt, 0);
+    av_opt_set_int(sws_context, "dstw", width, 0);
+    av_opt_set_int(sws_context, "dsth", height, 0);
+    av_opt_set_int(sws_context, "dst_format", format, 0);
+    av_opt_set_int(sws_context, "sws_flags", SWS_BILINEAR, 0);
+    av_opt_set_int(sws_context, "threads", threads, 0);
+
+    if (sws_init_context(sws_context, nullptr, nullptr) < 0) {
+        sws_freeContext(sws_context);
+        return nullptr;
+    }
+    return sws_context;
+}
+
+// Scales `frame` band by band so the convert stage works on one band while the slice threads scale the next. Every
+// row is published even on failure, the convert stage never waits on a frame forever.
+bool scale_frame(SwsContext* sws_context, const AVFrame& frame, ScaledFrame& scaled) {
+    const int height = scaled.image->height;
+    bool scaled_ok = true;
+
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    scaled_ok = sws_frame_start(sws_context, scaled.image, &frame) >= 0 &&
+                sws_send_slice(sws_context, 0, static_cast<unsigned int>(frame.height)) >= 0;
+
+    // Bands must start on the alignment swscale asks for, only the last one may be shorter
+    const int alignment = static_cast<int>(sws_receive_slice_alignment(sws_context));
+    const int band = ((height + SCALE_BANDS - 1) / SCALE_BANDS + alignment - 1) / alignment * alignment;
+
+    for (int row = 0; scaled_ok && row < height; row += band) {
+        const int rows = std::min(band, height - row);
+        scaled_ok =
+            sws_receive_slice(sws_context, static_cast<unsigned int>(row), static_cast<unsigned int>(rows)) >= 0;
+        scaled.publish_rows(row + rows);
+    }
+    sws_frame_end(sws_context);
+#else
+    scaled_ok = sws_scale(sws_context, frame.data, frame.linesize, 0, frame.height, scaled.image->data,
+                          scaled.image->linesize) > 0;
+#endif
+
+    scaled.publish_rows(height);
+    return scaled_ok;
+}
+
+struct OutputStats {
+    std::uint64_t frames = 0;
+    std::uint64_t late = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t escapes = 0;
+    Nanoseconds latency{0}; // Packet sent to frame written, leaving out the wait for the deadline
+    Nanoseconds max_latency{0};
+    utils::LatencyHistogram write;
+    utils::LatencyHistogram sleep; // Wait for the deadline of each frame
+};
+
+// Forwards draw_horiz_band calls to the band handler of the decode stage, stored in the codec context's opaque
+using BandHandler = std::function<void(const AVFrame& src, const int* offset, int y, int height)>;
+
+void draw_band(AVCodecContext* codec_context, const AVFrame* src, int offset[AV_NUM_DATA_POINTERS], const int y,
+               int /*type*/, const int height) {
+    (*static_cast<BandHandler*>(codec_context->opaque))(*src, offset, y, height);
+}
+
+void decode_stage(const Decoder& decoder, const Timing& timing, Pipeline& pipeline, DecodeStats& stats) {
+    utils::Tracer::attach_thread("decode");
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* packet = av_packet_alloc();
+
+    if (frame == nullptr || packet == nullptr) {
+        std::cerr << "Error allocating the frame and packet" << '\n';
+        pipeline.stop = true;
+    }
+
+    utils::FrameTimeline timeline(timing.time_base, timing.frame_interval, MAX_FRAME_GAP);
+    std::optional<Nanoseconds> last_forwarded;
+    Nanoseconds next_slot{0};
+    Clock::time_point sent; // Last packet handed to the decoder
+    std::uint64_t packets = 0;
+    std::uint64_t presented = 0;
+
+    // Skips frames above --max-fps and frames whose deadline has already passed, unless that would leave the
+    // screen without a new frame for longer than MAX_FRAME_GAP
+    const auto should_present = [&](const Nanoseconds pts) {
+        if (!last_forwarded) {
+            return true;
+        }
+        if (pts + FRAME_JITTER < next_slot) {
+            return false;
+        }
+        if (pipeline.clock.started() && Clock::now() > pipeline.clock.deadline(pts) &&
+            pts - *last_forwarded < MAX_FRAME_GAP) {
+            ++stats.dropped;
+            return false;
+        }
+        return true;
+    };
+
+    // Hands a frame to the convert stage before it is scaled, its rows follow through publish_rows. Without a
+    // scaler the converter area averages the decoded frame itself, which is referenced whole.
+    const auto start_frame = [&](const Nanoseconds pts, const AVFrame* decoded) {
+        last_forwarded = pts;
+        next_slot = std::max(next_slot + timing.min_interval, pts);
+
+        ScaledFrame* scaled = pipeline.scaled.acquire();
+        scaled->pts = pts;
+        scaled->number = presented++;
+        scaled->sent = sent;
+        scaled->rows.store(0, std::memory_order_relaxed);
+        if (decoded != nullptr ? av_frame_ref(scaled->image, decoded) < 0 : !decoder.frames->get(*scaled->image)) {
+            std::cerr << "Error referencing the frame" << '\n';
+            pipeline.stop = true;
+        }
+        pipeline.scaled.publish(scaled);
+        return scaled;
+    };
+
+    // --slices: the picture whose rows are scaled while its lower part is still being decoded
+    ScaledFrame* banded = nullptr;
+    bool band_skipped = false; // Its first band decided not to present it
+    std::int64_t band_timestamp = AV_NOPTS_VALUE;
+    int band_rows = 0;         // Source rows scaled
+    int banded_rows = 0;       // Output rows scaled
+    Nanoseconds band_scale_time{0};
+
+    const auto picture_timestamp = [](const AVFrame& picture) {
+        return picture.pts != AV_NOPTS_VALUE ? picture.pts : picture.pkt_dts;
+    };
+
+    BandHandler on_band = [&](const AVFrame& src, const int* offset, const int y, const int height) {
+        if (y == 0) {
+            if (banded != nullptr) {
+                banded->publish_rows(decoder.frames->height()); // The previous picture was never completed
+                banded = nullptr;
+            }
+            // Presentation is decided before the picture is complete, from the timestamp of its packet
+            band_timestamp = picture_timestamp(src);
+            const Nanoseconds pts = timeline.next(band_timestamp);
+            band_skipped = !should_present(pts);
+            if (band_skipped) {
+                return;
+            }
+            banded = start_frame(pts, nullptr);
+            band_rows = 0;
+            banded_rows = 0;
+            band_scale_time = Nanoseconds{0};
+        }
+        // Bands must arrive top to bottom, a picture missing one is rescaled whole once it is complete
+        if (banded == nullptr || y != band_rows) {
+            return;
+        }
+
+        std::array<const std::uint8_t*, AV_NUM_DATA_POINTERS> planes{};
+        for (std::size_t i = 0; i < planes.size(); ++i) {
+            planes[i] = src.data[i] != nullptr ? src.data[i] + offset[i] : nullptr;
+        }
+        const Clock::time_point scale_start = Clock::now();
+        banded_rows += sws_scale(decoder.sws_context, planes.data(), src.linesize, y, height, banded->image->data,
+                                 banded->image->linesize);
+        const Clock::time_point scale_end = Clock::now();
+        band_scale_time += scale_end - scale_start;
+        utils::Tracer::record("scale", "frame", banded->number, scale_start, scale_end);
+        band_rows = y + height;
+        banded->publish_rows(banded_rows);
+    };
+
+    if (decoder.slices) {
+        decoder.codec_context->opaque = &on_band;
+        decoder.codec_context->draw_horiz_band = draw_band;
+    }
+
+    // Completes `frame` when its bands have already been handled, returns false for frames to present normally
+    const auto finish_banded = [&] {
+        if (!band_skipped && banded == nullptr) {
+            return false;
+        }
+        // Bands come in decode order. A frame returned with another timestamp means the decoder reorders pictures
+        // and the bands belonged to a different one, so slice output stops: a skipped picture is left to come out
+        // on its own, a banded one gets the returned frame rescaled whole, presented at the other picture's time.
+        if (picture_timestamp(*frame) != band_timestamp) {
+            if (decoder.codec_context->draw_horiz_band != nullptr) {
+                std::cerr << "The decoder reorders frames, converting whole frames" << '\n';
+                decoder.codec_context->draw_horiz_band = nullptr;
+            }
+            band_rows = 0;
+            if (band_skipped) {
+                band_skipped = false;
+                return false;
+            }
+        }
+        if (band_skipped) {
+            band_skipped = false;
+            return true;
+        }
+        const Clock::time_point scale_start = Clock::now();
+        if (band_rows < frame->height && sws_scale(decoder.sws_context, frame->data, frame->linesize, 0,
+                                                   frame->height, banded->image->data, banded->image->linesize) <= 0) {
+            std::cerr << "Error scaling the frame" << '\n';
+            pipeline.stop = true;
+        }
+        const Clock::time_point scale_end = Clock::now();
+        stats.scale.record(band_scale_time + (scale_end - scale_start));
+        utils::Tracer::record("scale", "frame", banded->number, scale_start, scale_end);
+        banded->publish_rows(decoder.frames->height());
+        banded = nullptr;
+        return true;
+    };
+
+    // Returns the time spent in the decoder, scaling left out
+    const auto receive_frames = [&] {
+        Nanoseconds decoding{0};
+        auto decode_start = Clock::now();
+        while (avcodec_receive_frame(decoder.codec_context, frame) >= 0) {
+            decoding += Clock::now() - decode_start;
+            ++stats.decoded;
+
+            if (finish_banded()) {
+                decode_start = Clock::now();
+                continue;
+            }
+
+            const Nanoseconds pts = timeline.next(frame->best_effort_timestamp);
+            if (!should_present(pts)) {
+                decode_start = Clock::now();
+                continue;
+            }
+
+            if (decoder.sws_context == nullptr) {
+                start_frame(pts, frame);
+            } else {
+                ScaledFrame* scaled = start_frame(pts, nullptr);
+                const Clock::time_point scale_start = Clock::now();
+                const bool scaled_ok = scale_frame(decoder.sws_context, *frame, *scaled);
+                const Clock::time_point scale_end = Clock::now();
+                stats.scale.record(scale_end - scale_start);
+                utils::Tracer::record("scale", "frame", scaled->number, scale_start, scale_end);
+                if (!scaled_ok) {
+                    std::cerr << "Error scaling the frame" << '\n';
+                    pipeline.stop = true;
+                }
+            }
+
+            decode_start = Clock::now();
+        }
+        decoding += Clock::now() - decode_start;
+        return decoding;
+    };
+
+    while (!pipeline.stop) {
+        const Clock::time_point demux_start = Clock::now();
+        if (av_read_frame(decoder.format_context, packet) < 0) {
+            break;
+        }
+        const Clock::time_point demux_end = Clock::now();
+        stats.demux.record(demux_end - demux_start);
+        utils::Tracer::record("demux", "packet", packets, demux_start, demux_end);
+
+        if (packet->stream_index == decoder.video_stream_index &&
+            !should_decode(*packet, decoder.codec_context->skip_frame)) {
+            ++stats.skipped;
+            timeline.skip();
+        } else if (packet->stream_index == decoder.video_stream_index) {
+            const utils::TraceSpan span("decode", "packet", packets);
+            sent = Clock::now();
+            const int result = avcodec_send_packet(decoder.codec_context, packet);
+            Nanoseconds decoding = Clock::now() - sent;
+
+            if (result < 0) {
+                std::cerr << "Error sending a packet to the decoder" << '\n';
+                pipeline.stop = true;
+            } else {
+                decoding += receive_frames();
+            }
+            stats.decode_time += decoding;
+            stats.decode.record(decoding);
+        }
+        av_packet_unref(packet);
+        ++packets;
+    }
+
+    // Drain the frames still buffered in the decoder
+    sent = Clock::now();
+    if (!pipeline.stop && avcodec_send_packet(decoder.codec_context, nullptr) >= 0) {
+        const utils::TraceSpan span("decode", "packet", packets);
+        const Nanoseconds decoding = receive_frames();
+        stats.decode_time += decoding;
+        stats.decode.record(decoding);
+    }
+
+    if (banded != nullptr) {
+        banded->publish_rows(decoder.frames->height());
+    }
+    pipeline.scaled.close();
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+}
+
+struct ConvertOptions {
+    bool area;        // Frames are decoded ones to area average, not scaled ones
+    bool mono;
+    bool full_redraw;
+};
+
+// Converts each band as soon as it is scaled, or the whole decoded frame when area averaging. Returns once every
+// row has been scaled, so the frame can be released.
+bool convert_frame(AsciiArt::Converter& converter, const ConvertOptions& options, ScaledFrame& scaled,
+                   AsciiArt::CellFrame& cells, const std::atomic<bool>& stop) {
+    bool converted = true;
+    if (options.area) {
+        converted = stop || converter.convert_area(*scaled.image, options.mono, cells);
+    }
+    for (int row = options.area ? converter.height() : 0; row < converter.height();) {
+        const int ready = scaled.wait_rows(row);
+        if (converted && !stop) {
+            converted = converter.convert(*scaled.image, row, ready, cells);
+        }
+        row = ready;
+    }
+    av_frame_unref(scaled.image); // Back to the decoder's or the scaled frame pool
+    return converted;
+}
+
+// Encodes `cells` for the output stage, against `shown` unless redrawing fully, then swaps them so that `shown` is
+// the frame just handed over
+void publish_frame(const AsciiArt::Converter& converter, const ConvertOptions& options, AsciiArt::CellFrame& shown,
+                   AsciiArt::CellFrame& cells, const Nanoseconds pts, const std::uint64_t number,
+                   const Clock::time_point sent, Pipeline& pipeline, ConvertStats& stats) {
+    EncodedFrame* encoded = pipeline.encoded.acquire();
+    const Clock::time_point encode_start = Clock::now();
+    encoded->escapes = options.full_redraw ? converter.encode(cells, encoded->bands)
+                                           : converter.encode_diff(shown, cells, encoded->bands);
+    const Clock::time_point encode_end = Clock::now();
+    stats.encode.record(encode_end - encode_start);
+    utils::Tracer::record("encode", "frame", number, encode_start, encode_end);
+    encoded->pts = pts;
+    encoded->number = number;
+    encoded->sent = sent;
+    pipeline.encoded.publish(encoded);
+
+    std::swap(shown, cells);
+}
+
+void convert_stage(AsciiArt::Converter& converter, const ConvertOptions& options, Pipeline& pipeline,
+                   ConvertStats& stats) {
+    utils::Tracer::attach_thread("convert");
+    AsciiArt::CellFrame cells(converter.width(), converter.height());
+    AsciiArt::CellFrame shown; // Last frame handed to the output stage
+
+    while (ScaledFrame* scaled = pipeline.scaled.receive()) {
+        const Clock::time_point convert_start = Clock::now();
+        const bool converted = convert_frame(converter, options, *scaled, cells, pipeline.stop);
+        const Clock::time_point convert_end = Clock::now();
+        stats.convert.record(convert_end - convert_start);
+        utils::Tracer::record("convert", "frame", scaled->number, convert_start, convert_end);
+        const Nanoseconds pts = scaled->pts;
+        const std::uint64_t number = scaled->number;
+        const Clock::time_point sent = scaled->sent;
+        pipeline.scaled.release(scaled);
+
+        if (pipeline.stop) {
+            continue;
+        }
+        if (!converted) {
+            std::cerr << "Error converting the frame" << '\n';
+            pipeline.stop = true;
+            continue;
+        }
+        publish_frame(converter, options, shown, cells, pts, number, sent, pipeline, stats);
+    }
+
+    pipeline.encoded.close();
+}
+
+// Reorder buffer slot of a frame converted by one of the frame workers
+struct ConvertedFrame {
+    ScaledFrame* scaled = nullptr; // nullptr ends the stream
+    std::size_t sequence = 0;
+    AsciiArt::CellFrame cells;
+    bool converted = false;
+    Nanoseconds convert_time{0};
+};
+
+using FrameQueue = utils::SpscQueue<ConvertedFrame*>;
+
+void frame_worker(AsciiArt::Converter& converter, const ConvertOptions& options, FrameQueue& queue,
+                  utils::ReorderBuffer<ConvertedFrame>& reorder, const std::atomic<bool>& stop) {
+    utils::Tracer::attach_thread("frame worker");
+    while (ConvertedFrame* frame = queue.pop()) {
+        const std::size_t sequence = frame->sequence;
+        const std::uint64_t number = frame->scaled->number;
+        const Clock::time_point convert_start = Clock::now();
+        frame->converted = convert_frame(converter, options, *frame->scaled, frame->cells, stop);
+        const Clock::time_point convert_end = Clock::now();
+        frame->convert_time = convert_end - convert_start;
+        utils::Tracer::record("convert", "frame", number, convert_start, convert_end);
+        reorder.publish(sequence);
+    }
+}
+
+// Takes converted frames back in presentation order, releases their scaled frames and encodes them. The scaled ring
+// is received from by the dispatching thread and released to from this one, one thread per side as it requires.
+void sequence_stage(const AsciiArt::Converter& encoder, const ConvertOptions& options,
+                    utils::ReorderBuffer<ConvertedFrame>& reorder, Pipeline& pipeline, ConvertStats& stats) {
+    utils::Tracer::attach_thread("sequence");
+    AsciiArt::CellFrame shown;
+
+    while (true) {
+        ConvertedFrame& frame = reorder.front();
+        ScaledFrame* scaled = frame.scaled;
+        if (scaled == nullptr) {
+            break;
+        }
+        const Nanoseconds pts = scaled->pts;
+        const std::uint64_t number = scaled->number;
+        const Clock::time_point sent = scaled->sent;
+        pipeline.scaled.release(scaled);
+        stats.convert.record(frame.convert_time);
+
+        if (!pipeline.stop && !frame.converted) {
+            std::cerr << "Error converting the frame" << '\n';
+            pipeline.stop = true;
+        }
+        if (!pipeline.stop) {
+            publish_frame(encoder, options, shown, frame.cells, pts, number, sent, pipeline, stats);
+        }
+        reorder.pop();
+    }
+
+    pipeline.encoded.close();
+}
+
+// Converts whole frames concurrently instead of splitting each into row bands, for output sizes too small to split
+// well. Frames go round robin to one worker per converter and are encoded in presentation order behind a reorder
+// buffer as deep as the scaled frames in flight.
+void frame_parallel_stage(const AsciiArt::Converter& encoder, const std::span<AsciiArt::Converter> converters,
+                          const ConvertOptions& options, const std::size_t depth, Pipeline& pipeline,
+                          ConvertStats& stats) {
+    utils::ReorderBuffer<ConvertedFrame> reorder(depth);
+    std::vector<std::unique_ptr<FrameQueue>> queues;
+    std::vector<std::thread> workers;
+
+    for (AsciiArt::Converter& converter : converters) {
+        FrameQueue& queue = *queues.emplace_back(std::make_unique<FrameQueue>(depth));
+        workers.emplace_back(frame_worker, std::ref(converter), std::cref(options), std::ref(queue),
+                             std::ref(reorder), std::cref(pipeline.stop));
+    }
+    std::thread sequencer(sequence_stage, std::cref(encoder), std::cref(options), std::ref(reorder),
+                          std::ref(pipeline), std::ref(stats));
+
+    std::size_t sequence = 0;
+    while (ScaledFrame* scaled = pipeline.scaled.receive()) {
+        ConvertedFrame& frame = reorder.acquire(sequence);
+        frame.scaled = scaled;
+        frame.sequence = sequence;
+        queues[sequence % queues.size()]->push(&frame);
+        ++sequence;
+    }
+
+    for (const std::unique_ptr<FrameQueue>& queue : queues) {
+        queue->push(nullptr);
+    }
+    reorder.acquire(sequence).scaled = nullptr;
+    reorder.publish(sequence);
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    sequencer.join();
+}
+
+// Set from the SIGUSR1 handler, the output stage prints the stage table before its next frame
+volatile std::sig_atomic_t stage_table_requested = 0;
+
+void request_stage_table(int /*signal*/) {
+    stage_table_requested = 1;
+}
+
+// Writes frames to `fd` at their deadlines. A benchmark writes them as soon as they are encoded; the presentation
+// clock never starts then, so the decode stage drops nothing either.
+void output_stage(Pipeline& pipeline, const int fd, const bool benchmark, OutputStats& stats,
+                  const std::function<void()>& print_stage_table) {
+    utils::Tracer::attach_thread("output");
+    while (EncodedFrame* encoded = pipeline.encoded.receive()) {
+        if (stage_table_requested != 0) {
+            stage_table_requested = 0;
+            print_stage_table();
+        }
+        if (pipeline.stop) {
+            pipeline.encoded.release(encoded);
+            continue;
+        }
+
+        // Sleep until the absolute deadline so that write and wake-up jitter do not accumulate
+        if (!benchmark && !pipeline.clock.started()) {
+            pipeline.clock.start(Clock::now(), encoded->pts);
+        }
+        const Clock::time_point now = Clock::now();
+        Nanoseconds waited{0};
+        if (!benchmark) {
+            const Clock::time_point deadline = pipeline.clock.deadline(encoded->pts);
+            if (now < deadline) {
+                std::this_thread::sleep_until(deadline);
+                waited = Clock::now() - now;
+                utils::Tracer::record("sleep", "frame", encoded->number, now, now + waited);
+            } else if (now - deadline > LATE_TOLERANCE) {
+                ++stats.late;
+            }
+            stats.sleep.record(waited);
+        }
+
+        const Clock::time_point write_start = Clock::now();
+        if (!AsciiArt::write_frame(fd, encoded->bands)) {
+            std::cerr << "Error writing the frame" << '\n';
+            pipeline.stop = true;
+        }
+        const Clock::time_point write_end = Clock::now();
+        stats.write.record(write_end - write_start);
+        utils::Tracer::record("write", "frame", encoded->number, write_start, write_end);
+
+        const Nanoseconds latency = write_end - encoded->sent - waited;
+        stats.latency += latency;
+        stats.max_latency = std::max(stats.max_latency, latency);
+
+        ++stats.frames;
+        stats.bytes += std::accumulate(encoded->bands.begin(), encoded->bands.end(), std::uint64_t{0},
+                                       [](const std::uint64_t sum, const AsciiArt::ByteBuffer& band) {
+                                           return sum + band.size();
+                                       });
+        stats.escapes += encoded->escapes;
+        pipeline.encoded.release(encoded);
+    }
+}
+
+double milliseconds(const Nanoseconds duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+void print_stage_row(const std::string_view stage, const utils::LatencyHistogram& times) {
+    if (times.count() == 0) {
+        return;
+    }
+    std::cerr << std::format("{:<8}{:>8}{:>10.3f}{:>10.3f}{:>10.3f}{:>10.3f}{:>10.3f}", stage, times.count(),
+                             milliseconds(times.mean()), milliseconds(times.percentile(50)),
+                             milliseconds(times.percentile(90)), milliseconds(times.percentile(99)),
+                             milliseconds(times.max()))
+              << '\n';
+}
+
+void print_stage_table(const DecodeStats& decode_stats, const ConvertStats& convert_stats,
+                       const OutputStats& output_stats) {
+    std::cerr << std::format("{:<8}{:>8}{:>10}{:>10}{:>10}{:>10}{:>10}", "Stage", "Count", "Mean ms", "P50 ms",
+                             "P90 ms", "P99 ms", "Max ms")
+              << '\n';
+    print_stage_row("demux", decode_stats.demux);
+    print_stage_row("decode", decode_stats.decode);
+    print_stage_row("scale", decode_stats.scale);
+    print_stage_row("convert", convert_stats.convert);
+    print_stage_row("encode", convert_stats.encode);
+    print_stage_row("write", output_stats.write);
+    print_stage_row("sleep", output_stats.sleep);
+}
+
+// Input and totals of a benchmark run for its JSON report
+struct ReportInfo {
+    std::string_view codec;
+    int width;
+    int height;
+    int output_width;
+    int output_height;
+    std::uint64_t frames;
+    double seconds;
+    std::uint64_t bytes;
+};
+
+std::string stage_json(const std::string_view stage, const utils::LatencyHistogram& times) {
+    return std::format("\"{}\": {{\"count\": {}, \"mean_ms\": {:.4f}, \"p50_ms\": {:.4f}, \"p90_ms\": {:.4f}, "
+                       "\"p99_ms\": {:.4f}, \"max_ms\": {:.4f}}}",
+                       stage, times.count(), milliseconds(times.mean()), milliseconds(times.percentile(50)),
+                       milliseconds(times.percentile(90)), milliseconds(times.percentile(99)),
+                       milliseconds(times.max()));
+}
+
+bool write_report(const std::filesystem::path& path, const ReportInfo& info, const DecodeStats& decode_stats,
+                  const ConvertStats& convert_stats, const OutputStats& output_stats) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    const auto frames = static_cast<double>(std::max<std::uint64_t>(info.frames, 1));
+    out << std::format("{{\"codec\": \"{}\", \"width\": {}, \"height\": {}, \"output_width\": {}, "
+                       "\"output_height\": {},\n",
+                       info.codec, info.width, info.height, info.output_width, info.output_height);
+    out << std::format(" \"frames\": {}, \"seconds\": {:.4f}, \"fps\": {:.2f}, \"bytes\": {}, "
+                       "\"bytes_per_frame\": {:.0f},\n",
+                       info.frames, info.seconds, static_cast<double>(info.frames) / info.seconds, info.bytes,
+                       static_cast<double>(info.bytes) / frames);
+    out << " \"stages\": {\n  " << stage_json("demux", decode_stats.demux) << ",\n  "
+        << stage_json("decode", decode_stats.decode) << ",\n  " << stage_json("scale", decode_stats.scale)
+        << ",\n  " << stage_json("convert", convert_stats.convert) << ",\n  "
+        << stage_json("encode", convert_stats.encode) << ",\n  " << stage_json("write", output_stats.write)
+        << ",\n  " << stage_json("sleep", output_stats.sleep) << "\n }\n}\n";
+    return static_cast<bool>(out);
+}
+
+} // namespace
 
 int main(int argc, char** argv) {
     double max_fps = 144.0; // Screen refresh rate
+    int lut_bits = 0;       // Arithmetic conversion
+    bool show_stats = false;
+    bool benchmark = false;
+    std::filesystem::path report_path;
+    std::filesystem::path trace_path;
+    std::filesystem::path output_path; // Terminal when empty
+    bool full_redraw = false;
+    bool mono = false;
+    bool slices = false;
+    bool area = true; // Area average into cells instead of scaling with swscale
+    int decode_threads = 0;  // Auto
+    int scale_threads = 0;   // Auto
+    int convert_threads = 0; // Auto
+    int frame_threads = 1;   // Frames converted at once
+    ThreadType thread_type = ThreadType::Auto;
+    SkipMode skip_mode = SkipMode::None;
     std::filesystem::path video_path;
 
     utils::cmd::add_option(
         {.name = "max-fps", .description = "Set maximum frames per second", .value = "fps", .default_value = 144});
+    utils::cmd::add_option({.name = "lut-bits",
+                            .description = "Map colors through a lookup table quantized to this many bits per channel "
+                                           "(4-8, 0 disables)",
+                            .value = "bits",
+                            .default_value = 0});
+    utils::cmd::add_option({.name = "decode-threads",
+                            .description = "Set decoder threads, 0 picks them from the core count and resolution",
+                            .value = "n",
+                            .default_value = 0});
+    utils::cmd::add_option({.name = "thread-type",
+                            .description = "Set decoder threading: auto, frame or slice",
+                            .value = "type",
+                            .default_value = std::string_view("auto")});
+    utils::cmd::add_option({.name = "scale-threads",
+                            .description = "Set scaler slice threads, 0 picks them from the core count and resolution",
+                            .value = "n",
+                            .default_value = 0});
+    utils::cmd::add_option({.name = "threads",
+                            .description = "Set threads converting and encoding row bands of a frame, 0 uses every "
+                                           "core",
+                            .value = "n",
+                            .default_value = 0});
+    utils::cmd::add_option({.name = "frame-threads",
+                            .description = "Convert this many whole frames at once and reorder them for output, "
+                                           "instead of splitting each frame into row bands",
+                            .value = "n",
+                            .default_value = 1});
+    utils::cmd::add_option({.name = "skip-frames",
+                            .description = "Let the decoder skip frames: none, nonref (non-reference frames) or nonkey "
+                                           "(keyframes only)",
+                            .value = "mode",
+                            .default_value = std::string_view("none")});
+    utils::cmd::add_option(
+        {.name = "full-redraw", .description = "Redraw every cell instead of only the changed ones"});
+    utils::cmd::add_option({.name = "scaler",
+                            .description = "Downscale with area (averaged straight into cells, for YUV420P, NV12 "
+                                           "and YUV444P) or sws, which --slices and --lut-bits always use",
+                            .value = "name",
+                            .default_value = std::string_view("area")});
+    utils::cmd::add_option({.name = "slices",
+                            .description = "Start converting the top of a frame while the rest decodes, for codecs "
+                                           "with slice output on streams that do not reorder frames"});
+    utils::cmd::add_option({.name = "mono", .description = "Draw glyphs from luma only, without colors"});
+    utils::cmd::add_option({.name = "stats",
+                            .description = "Print output statistics and per-stage latency percentiles at exit, and "
+                                           "the latter on SIGUSR1"});
+    utils::cmd::add_option({.name = "benchmark",
+                            .description = "Convert every frame as fast as possible, without writing to the terminal "
+                                           "unless --output is given, and print per-stage timings"});
+    utils::cmd::add_option({.name = "report",
+                            .description = "Also write the benchmark results as JSON to this file, implies "
+                                           "--benchmark",
+                            .value = "file"});
+    utils::cmd::add_option({.name = "trace",
+                            .description = "Record every stage of every frame and write the timeline to this file "
+                                           "in the Chrome trace-event format",
+                            .value = "file"});
+    utils::cmd::add_option({.name = "output", .description = "Write frames to this file instead", .value = "file"});
     utils::cmd::add_option({.alt = 'h', .name = "help", .description = "Show this help message"});
     utils::cmd::add_positional("FILE");
 
@@ -40,6 +991,104 @@ int main(int argc, char** argv) {
                 return 1;
             }
             max_fps = std::max(fps, MIN_FPS);
+        } else if (arg == "--lut-bits") {
+            const auto bits_str = utils::cmd::shift(argc, argv);
+            int bits = 0;
+            if (std::from_chars(bits_str.data(), bits_str.data() + bits_str.size(), bits).ec != std::errc() ||
+                (bits != 0 && (bits < AsciiArt::ColorLut::MIN_BITS || bits > AsciiArt::ColorLut::MAX_BITS))) {
+                std::cerr << "Invalid lut bits value: " << bits_str << '\n';
+                return 1;
+            }
+            lut_bits = bits;
+        } else if (arg == "--decode-threads") {
+            const auto threads_str = utils::cmd::shift(argc, argv);
+            int threads = 0;
+            if (std::from_chars(threads_str.data(), threads_str.data() + threads_str.size(), threads).ec !=
+                    std::errc() ||
+                threads < 0) {
+                std::cerr << "Invalid decode threads value: " << threads_str << '\n';
+                return 1;
+            }
+            decode_threads = threads;
+        } else if (arg == "--thread-type") {
+            const auto type_str = utils::cmd::shift(argc, argv);
+            if (type_str == "auto") {
+                thread_type = ThreadType::Auto;
+            } else if (type_str == "frame") {
+                thread_type = ThreadType::Frame;
+            } else if (type_str == "slice") {
+                thread_type = ThreadType::Slice;
+            } else {
+                std::cerr << "Invalid thread type: " << type_str << '\n';
+                return 1;
+            }
+        } else if (arg == "--scale-threads") {
+            const auto threads_str = utils::cmd::shift(argc, argv);
+            int threads = 0;
+            if (std::from_chars(threads_str.data(), threads_str.data() + threads_str.size(), threads).ec !=
+                    std::errc() ||
+                threads < 0) {
+                std::cerr << "Invalid scale threads value: " << threads_str << '\n';
+                return 1;
+            }
+            scale_threads = threads;
+        } else if (arg == "--threads") {
+            const auto threads_str = utils::cmd::shift(argc, argv);
+            int threads = 0;
+            if (std::from_chars(threads_str.data(), threads_str.data() + threads_str.size(), threads).ec !=
+                    std::errc() ||
+                threads < 0) {
+                std::cerr << "Invalid threads value: " << threads_str << '\n';
+                return 1;
+            }
+            convert_threads = threads;
+        } else if (arg == "--frame-threads") {
+            const auto threads_str = utils::cmd::shift(argc, argv);
+            int threads = 0;
+            if (std::from_chars(threads_str.data(), threads_str.data() + threads_str.size(), threads).ec !=
+                    std::errc() ||
+                threads < 1) {
+                std::cerr << "Invalid frame threads value: " << threads_str << '\n';
+                return 1;
+            }
+            frame_threads = threads;
+        } else if (arg == "--skip-frames") {
+            const auto mode_str = utils::cmd::shift(argc, argv);
+            if (mode_str == "none") {
+                skip_mode = SkipMode::None;
+            } else if (mode_str == "nonref") {
+                skip_mode = SkipMode::NonRef;
+            } else if (mode_str == "nonkey") {
+                skip_mode = SkipMode::NonKey;
+            } else {
+                std::cerr << "Invalid skip frames mode: " << mode_str << '\n';
+                return 1;
+            }
+        } else if (arg == "--full-redraw") {
+            full_redraw = true;
+        } else if (arg == "--scaler") {
+            const auto scaler_str = utils::cmd::shift(argc, argv);
+            if (scaler_str == "area" || scaler_str == "sws") {
+                area = scaler_str == "area";
+            } else {
+                std::cerr << "Invalid scaler: " << scaler_str << '\n';
+                return 1;
+            }
+        } else if (arg == "--slices") {
+            slices = true;
+        } else if (arg == "--mono") {
+            mono = true;
+        } else if (arg == "--stats") {
+            show_stats = true;
+        } else if (arg == "--benchmark") {
+            benchmark = true;
+        } else if (arg == "--report") {
+            report_path = static_cast<std::filesystem::path>(utils::cmd::shift(argc, argv));
+            benchmark = true;
+        } else if (arg == "--trace") {
+            trace_path = static_cast<std::filesystem::path>(utils::cmd::shift(argc, argv));
+        } else if (arg == "--output") {
+            output_path = static_cast<std::filesystem::path>(utils::cmd::shift(argc, argv));
         } else {
             video_path = static_cast<std::filesystem::path>(arg);
         }
@@ -84,9 +1133,17 @@ int main(int argc, char** argv) {
 
     AVStream* video_stream = format_context->streams[video_stream_index];
     const AVRational frame_rate = av_guess_frame_rate(format_context, video_stream, nullptr);
-    const double fps = av_q2d(frame_rate);
+    const double fps = frame_rate.num > 0 && frame_rate.den > 0 ? av_q2d(frame_rate) : max_fps;
 
-    const double target_fps = std::clamp(fps, MIN_FPS, max_fps);
+    // A benchmark presents every frame, so neither --max-fps nor auto frame skipping applies
+    const double target_fps = benchmark ? fps : std::clamp(fps, MIN_FPS, max_fps);
+    const Nanoseconds min_interval =
+        benchmark ? Nanoseconds{0}
+                  : std::chrono::duration_cast<Nanoseconds>(std::chrono::duration<double>(1.0 / target_fps));
+    const Timing timing{
+        .time_base = video_stream->time_base,
+        .frame_interval = std::chrono::duration_cast<Nanoseconds>(std::chrono::duration<double>(1.0 / fps)),
+        .min_interval = min_interval};
 
     const AVCodecParameters* codec_parameters = video_stream->codecpar;
     const AVCodec* codec = avcodec_find_decoder(codec_parameters->codec_id);
@@ -103,6 +1160,37 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if (slices && (codec->capabilities & AV_CODEC_CAP_DRAW_HORIZ_BAND) == 0) {
+        std::cerr << "The decoder has no slice output, converting whole frames" << '\n';
+        slices = false;
+    }
+    if (slices && codec_context->has_b_frames > 0) {
+        std::cerr << "The stream reorders frames, converting whole frames" << '\n';
+        slices = false;
+    }
+    // Bands come in order only from a decoder on a single thread, and are scaled with the one-shot slice API
+    if (slices) {
+        decode_threads = 1;
+        scale_threads = 1;
+    }
+
+    codec_context->thread_count = decode_threads > 0
+                                      ? decode_threads
+                                      : auto_thread_count(codec_context->width, codec_context->height);
+    switch (thread_type) {
+    case ThreadType::Auto:
+        codec_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        break;
+    case ThreadType::Frame:
+        codec_context->thread_type = FF_THREAD_FRAME;
+        break;
+    case ThreadType::Slice:
+        codec_context->thread_type = FF_THREAD_SLICE;
+        break;
+    }
+
+    codec_context->skip_frame = skip_frame_discard(skip_mode);
+
     if (avcodec_open2(codec_context, codec, nullptr) < 0) {
         std::cerr << "Error opening the codec" << '\n';
         return 1;
@@ -111,70 +1199,187 @@ int main(int argc, char** argv) {
     const float aspect_ratio = static_cast<float>(codec_context->height) / static_cast<float>(codec_context->width);
     const int output_height = static_cast<int>(OUTPUT_WIDTH * aspect_ratio * 0.45);
 
+    area = area && !slices && lut_bits == 0 && AsciiArt::Converter::supports_area(codec_context->pix_fmt);
+
+    const AVPixelFormat pixel_format = scaled_format(codec_context->pix_fmt, mono, lut_bits != 0);
+    if (scale_threads == 0) {
+        scale_threads = auto_thread_count(codec_context->width, codec_context->height);
+    }
     SwsContext* sws_context =
-        sws_getContext(codec_context->width, codec_context->height, codec_context->pix_fmt, OUTPUT_WIDTH, output_height,
-                       AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        area ? nullptr : create_scaler(*codec_context, OUTPUT_WIDTH, output_height, pixel_format, scale_threads);
 
-    if (sws_context == nullptr) {
+    if (!area && sws_context == nullptr) {
         std::cerr << "Error creating the sws context" << '\n';
         return 1;
     }
 
-    AVFrame* frame = av_frame_alloc();
-    AVFrame* rgb_frame = av_frame_alloc();
-    AVPacket* packet = av_packet_alloc();
+    // Frames in flight: scaled frames go from the decoder to the converter, encoded ones to the terminal. Frame
+    // workers hold one scaled frame each on top of those.
+    const std::size_t scaled_depth = PIPELINE_DEPTH + (frame_threads > 1 ? frame_threads : 0);
+    std::vector<ScaledFrame> scaled_frames(scaled_depth);
+    std::array<EncodedFrame, PIPELINE_DEPTH> encoded_frames{};
 
-    if (frame == nullptr || rgb_frame == nullptr || packet == nullptr) {
-        std::cerr << "Error allocating the frames and packet" << '\n';
-        return 1;
+    for (ScaledFrame& scaled : scaled_frames) {
+        scaled.image = av_frame_alloc();
+        if (scaled.image == nullptr) {
+            std::cerr << "Error allocating the frames" << '\n';
+            return 1;
+        }
     }
 
-    const int rgb_frame_size = av_image_get_buffer_size(AV_PIX_FMT_RGB24, OUTPUT_WIDTH, output_height, 1);
-    const auto* rgb_framebuffer = static_cast<unsigned char*>(av_malloc(rgb_frame_size * sizeof(unsigned char)));
+    // Area averaging references decoded frames instead. swscale keeps the matrix and, between identical layouts, the
+    // range; converted sources end up limited range.
+    std::optional<FramePool> frame_pool;
+    if (!area) {
+        frame_pool.emplace(pixel_format, OUTPUT_WIDTH, output_height, codec_context->colorspace,
+                           pixel_format == codec_context->pix_fmt ? codec_context->color_range : AVCOL_RANGE_MPEG);
+        if (!frame_pool->valid()) {
+            std::cerr << "Error allocating the frames" << '\n';
+            return 1;
+        }
+    }
 
-    av_image_fill_arrays(rgb_frame->data, rgb_frame->linesize, rgb_framebuffer, AV_PIX_FMT_RGB24, OUTPUT_WIDTH,
-                         output_height, 1);
+    const Decoder decoder{.format_context = format_context,
+                          .codec_context = codec_context,
+                          .sws_context = sws_context,
+                          .frames = frame_pool ? &*frame_pool : nullptr,
+                          .video_stream_index = video_stream_index,
+                          .slices = slices};
+    if (convert_threads == 0) {
+        convert_threads = static_cast<int>(std::max(1U, std::thread::hardware_concurrency()));
+    }
+    utils::WorkerPool pool(static_cast<std::size_t>(convert_threads));
+    AsciiArt::Converter converter(OUTPUT_WIDTH, output_height, lut_bits, &pool);
+    // Frame workers convert on their own, the banded converter then only encodes
+    std::vector<AsciiArt::Converter> frame_converters;
+    if (frame_threads > 1) {
+        frame_converters.reserve(frame_threads);
+        for (int i = 0; i < frame_threads; ++i) {
+            frame_converters.emplace_back(OUTPUT_WIDTH, output_height, lut_bits);
+        }
+    }
+    Pipeline pipeline(scaled_frames, encoded_frames);
 
-    std::vector<AsciiArt::ColoredPixel> asciiArt(static_cast<size_t>(OUTPUT_WIDTH * output_height));
+    int output_fd = STDOUT_FILENO;
+    if (!output_path.empty() || benchmark) {
+        output_fd = ::open(output_path.empty() ? "/dev/null" : output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fd < 0) {
+            std::cerr << "Error opening the output: " << (output_path.empty() ? "/dev/null" : output_path) << '\n';
+            return 1;
+        }
+    }
 
-    const auto frame_delay = std::chrono::milliseconds(static_cast<int>(1000 / target_fps));
-    auto last_frame_time = std::chrono::steady_clock::now();
+    DecodeStats decode_stats;
+    ConvertStats convert_stats;
+    OutputStats stats;
+    const bool stage_times = show_stats || benchmark;
+    if (stage_times) {
+        decode_stats.demux.enable();
+        decode_stats.decode.enable();
+        decode_stats.scale.enable();
+        convert_stats.convert.enable();
+        convert_stats.encode.enable();
+        stats.write.enable();
+        stats.sleep.enable();
+        std::signal(SIGUSR1, request_stage_table);
+    }
 
-    while (av_read_frame(format_context, packet) >= 0) {
-        if (packet->stream_index == video_stream_index) {
-            if (avcodec_send_packet(codec_context, packet) < 0) {
-                std::cerr << "Error sending a packet to the decoder" << '\n';
-                break;
-            }
+    std::optional<utils::Tracer> tracer;
+    if (!trace_path.empty()) {
+        tracer.emplace(TRACE_SPANS);
+    }
 
-            while (avcodec_receive_frame(codec_context, frame) >= 0) {
-                sws_scale(sws_context, frame->data, frame->linesize, 0, codec_context->height, rgb_frame->data,
-                          rgb_frame->linesize);
+    const Clock::time_point start = Clock::now();
+    std::thread decode_thread(decode_stage, std::cref(decoder), std::cref(timing), std::ref(pipeline),
+                              std::ref(decode_stats));
+    const ConvertOptions convert_options{.area = area, .mono = mono, .full_redraw = full_redraw};
+    std::thread convert_thread = frame_converters.empty()
+                                     ? std::thread(convert_stage, std::ref(converter), std::cref(convert_options),
+                                                   std::ref(pipeline), std::ref(convert_stats))
+                                     : std::thread(frame_parallel_stage, std::cref(converter),
+                                                   std::span(frame_converters), std::cref(convert_options),
+                                                   scaled_depth, std::ref(pipeline), std::ref(convert_stats));
 
-                asciiArt = AsciiArt::frame_to_ascii(rgb_frame, OUTPUT_WIDTH, output_height, 3);
+    output_stage(pipeline, output_fd, benchmark, stats,
+                 [&] { print_stage_table(decode_stats, convert_stats, stats); });
 
-                std::cout << "\033[H"; // Move cursor to top-left
-                print_ascii_frame(asciiArt, OUTPUT_WIDTH, output_height);
-                std::cout.flush();
+    convert_thread.join();
+    decode_thread.join();
+    const std::chrono::duration<double> elapsed = Clock::now() - start;
 
-                const auto current_time = std::chrono::steady_clock::now();
-                const auto elapsed_time =
-                    std::chrono::duration_cast<std::chrono::milliseconds>(current_time - last_frame_time);
+    if (output_fd != STDOUT_FILENO) {
+        ::close(output_fd);
+    }
 
-                if (elapsed_time < frame_delay) {
-                    std::this_thread::sleep_for(frame_delay - elapsed_time);
-                }
+    if (tracer) {
+        if (tracer->dropped() > 0) {
+            std::cerr << std::format("Trace buffers full, {} spans dropped", tracer->dropped()) << '\n';
+        }
+        if (!tracer->write(trace_path)) {
+            std::cerr << "Error writing the trace: " << trace_path << '\n';
+            return 1;
+        }
+    }
 
-                last_frame_time = std::chrono::steady_clock::now();
-            }
+    if (benchmark) {
+        const auto frames = static_cast<double>(std::max<std::uint64_t>(stats.frames, 1));
+        std::cerr << std::format("Benchmark: {} frames in {:.2f} s, {:.1f} frames/s, {:.0f} bytes/frame",
+                                 stats.frames, elapsed.count(), static_cast<double>(stats.frames) / elapsed.count(),
+                                 static_cast<double>(stats.bytes) / frames)
+                  << '\n';
+
+        const ReportInfo info{.codec = codec->name,
+                              .width = codec_context->width,
+                              .height = codec_context->height,
+                              .output_width = OUTPUT_WIDTH,
+                              .output_height = output_height,
+                              .frames = stats.frames,
+                              .seconds = elapsed.count(),
+                              .bytes = stats.bytes};
+        if (!report_path.empty() && !write_report(report_path, info, decode_stats, convert_stats, stats)) {
+            std::cerr << "Error writing the report: " << report_path << '\n';
+            return 1;
         }
-        av_packet_unref(packet);
     }
 
+    const bool print_stats = show_stats && stats.frames > 0;
+    if (!print_stats && (decode_stats.dropped > 0 || stats.late > 0)) {
+        std::cerr << std::format("Dropped: {} frames, late: {} frames", decode_stats.dropped, stats.late) << '\n';
+    }
+    if (print_stats) {
+        const auto cells = static_cast<double>(OUTPUT_WIDTH) * output_height;
+        const auto frames = static_cast<double>(stats.frames);
+        std::cerr << std::format("Frames: {}, bytes/frame: {:.0f}, color escapes/frame: {:.0f} ({:.1f}% of cells)",
+                                 stats.frames, static_cast<double>(stats.bytes) / frames,
+                                 static_cast<double>(stats.escapes) / frames,
+                                 100.0 * static_cast<double>(stats.escapes) / (frames * cells))
+                  << '\n';
+        std::cerr << std::format("Skipped: {} packets, dropped: {}, late: {}", decode_stats.skipped,
+                                 decode_stats.dropped, stats.late)
+                  << '\n';
+        const std::chrono::duration<double, std::milli> latency = stats.latency;
+        const std::chrono::duration<double, std::milli> max_latency = stats.max_latency;
+        std::cerr << std::format("Latency: {:.2f} ms mean, {:.2f} ms max from packet to terminal{}",
+                                 latency.count() / frames, max_latency.count(), slices ? " (slices)" : "")
+                  << '\n';
+        if (decode_stats.decoded > 0) {
+            const std::chrono::duration<double, std::milli> decode_time = decode_stats.decode_time;
+            std::cerr << std::format("Decoded: {} frames at {}x{}, {:.2f} ms/frame, {} threads ({})",
+                                     decode_stats.decoded, codec_context->width, codec_context->height,
+                                     decode_time.count() / static_cast<double>(decode_stats.decoded),
+                                     codec_context->thread_count,
+                                     thread_type_name(codec_context->active_thread_type))
+                      << '\n';
+        }
+    }
+    if (stage_times) {
+        print_stage_table(decode_stats, convert_stats, stats);
+    }
+
+    for (ScaledFrame& scaled : scaled_frames) {
+        av_frame_free(&scaled.image);
+    }
     sws_freeContext(sws_context);
-    av_frame_free(&rgb_frame);
-    av_frame_free(&frame);
-    av_packet_free(&packet);
     avcodec_free_context(&codec_context);
     avformat_close_input(&format_context);
 
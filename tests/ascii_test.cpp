@@ -0,0 +1,544 @@
+#include "ascii_lib.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Unit tests of ascii_lib, run by `make test`. Every failed check is printed and the run exits with an error.
+
+namespace {
+
+// Heap allocations so far, counted by the replaced operator new
+std::atomic<std::size_t> allocations{0};
+
+} // namespace
+
+// None of these are inlined, GCC would see free() on a pointer from operator new at every delete
+[[gnu::noinline]] void* operator new(const std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+namespace {
+
+int failures = 0;
+
+void check(const bool ok, const std::string_view what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << '\n';
+        ++failures;
+    }
+}
+
+std::string_view simd_level_name(const AsciiArt::SimdLevel level) {
+    switch (level) {
+    case AsciiArt::SimdLevel::Scalar:
+        return "scalar";
+    case AsciiArt::SimdLevel::SSE41:
+        return "sse41";
+    case AsciiArt::SimdLevel::AVX2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+// Vector levels this CPU runs, rgb_row_kernel falls back to a lower one for the others
+std::vector<AsciiArt::SimdLevel> vector_levels() {
+    std::vector<AsciiArt::SimdLevel> levels;
+    const AsciiArt::SimdLevel detected = AsciiArt::detect_simd_level();
+    if (detected == AsciiArt::SimdLevel::SSE41 || detected == AsciiArt::SimdLevel::AVX2) {
+        levels.push_back(AsciiArt::SimdLevel::SSE41);
+    }
+    if (detected == AsciiArt::SimdLevel::AVX2) {
+        levels.push_back(AsciiArt::SimdLevel::AVX2);
+    }
+    return levels;
+}
+
+// Every width up to a few AVX2 blocks, so each mix of vector blocks and scalar tail is covered, plus wide rows
+std::vector<int> kernel_widths() {
+    std::vector<int> widths;
+    for (int w = 0; w <= 100; ++w) {
+        widths.push_back(w);
+    }
+    for (const int w : {127, 128, 129, 255, 256, 257, 600, 1919, 1920, 1921}) {
+        widths.push_back(w);
+    }
+    return widths;
+}
+
+// Random bytes, or bytes drawn from the edges of the glyph bins and color cube steps
+std::vector<unsigned char> kernel_input(std::mt19937& rng, const std::size_t size, const bool edges) {
+    constexpr std::array<unsigned char, 14> EDGE_VALUES = {0, 1, 50, 51, 52, 101, 102, 127, 128, 153, 204, 205, 254,
+                                                           255};
+    std::vector<unsigned char> bytes(size);
+    for (unsigned char& byte : bytes) {
+        byte = edges ? EDGE_VALUES[rng() % EDGE_VALUES.size()] : static_cast<unsigned char>(rng());
+    }
+    return bytes;
+}
+
+void test_rgb_row_kernels() {
+    constexpr char GLYPH_GUARD = '!';
+    constexpr unsigned char COLOR_GUARD = 0xA5;
+    constexpr int GUARD_CELLS = 64; // Past the row, must stay untouched
+
+    std::mt19937 rng(1);
+    for (const AsciiArt::SimdLevel level : vector_levels()) {
+        const AsciiArt::RgbRowKernel kernel = AsciiArt::rgb_row_kernel(level);
+        for (const int width : kernel_widths()) {
+            for (const bool edges : {false, true}) {
+                const std::vector<unsigned char> rgb = kernel_input(rng, static_cast<std::size_t>(width) * 3, edges);
+                const std::size_t cells = static_cast<std::size_t>(width) + GUARD_CELLS;
+
+                std::vector<char> expectedGlyphs(cells, GLYPH_GUARD);
+                std::vector<unsigned char> expectedColors(cells, COLOR_GUARD);
+                AsciiArt::rgb_row_to_ascii_scalar(rgb.data(), width, expectedGlyphs.data(), expectedColors.data());
+
+                std::vector<char> glyphs(cells, GLYPH_GUARD);
+                std::vector<unsigned char> colors(cells, COLOR_GUARD);
+                kernel(rgb.data(), width, glyphs.data(), colors.data());
+
+                const std::string name = std::string("rgb_row/") + std::string(simd_level_name(level)) + " width " +
+                                         std::to_string(width) + (edges ? " edge values" : " random");
+                check(glyphs == expectedGlyphs, name + ": glyphs differ from the scalar kernel");
+                check(colors == expectedColors, name + ": colors differ from the scalar kernel");
+            }
+        }
+    }
+}
+
+void test_accumulate_row_kernels() {
+    constexpr int ROWS = 0xFFFF / 0xFF; // As many as the 16-bit sums hold, carrying into their high bytes
+
+    std::mt19937 rng(2);
+    for (const AsciiArt::SimdLevel level : vector_levels()) {
+        const AsciiArt::AccumulateRowKernel kernel = AsciiArt::accumulate_row_kernel(level);
+        for (const int width : kernel_widths()) {
+            const std::vector<unsigned char> row = kernel_input(rng, static_cast<std::size_t>(width), false);
+            std::vector<std::uint16_t> expected(static_cast<std::size_t>(width) + 1, 0);
+            std::vector<std::uint16_t> actual(expected.size(), 0);
+            for (int i = 0; i < ROWS; ++i) {
+                AsciiArt::accumulate_row_scalar(row.data(), width, expected.data());
+                kernel(row.data(), width, actual.data());
+            }
+            check(actual == expected, std::string("accumulate_row/") + std::string(simd_level_name(level)) +
+                                          " width " + std::to_string(width) + ": sums differ from the scalar kernel");
+        }
+    }
+}
+
+// The full glyph ramp on a gray gradient, so that the integer luma reaches every glyph and no other
+void test_glyph_ramp() {
+    const auto glyphCount = static_cast<int>(AsciiArt::ASCII_CHARS.size());
+    std::vector<unsigned char> rgb;
+    for (int i = 0; i < glyphCount; ++i) {
+        // Lowest gray of bin i
+        const auto gray = static_cast<unsigned char>((i * 256 + glyphCount - 1) / glyphCount);
+        rgb.insert(rgb.end(), {gray, gray, gray});
+    }
+    std::vector<char> glyphs(glyphCount);
+    std::vector<unsigned char> colors(glyphCount);
+    AsciiArt::rgb_row_to_ascii_scalar(rgb.data(), glyphCount, glyphs.data(), colors.data());
+    check(std::string_view(glyphs.data(), glyphs.size()) == AsciiArt::ASCII_CHARS, "glyph ramp on a gray gradient");
+
+    check(AsciiArt::pixel_to_ascii(0, 0, 0).ascii == '.' && AsciiArt::pixel_to_ascii(0, 0, 0).colorIndex == 16,
+          "pixel_to_ascii of black");
+    check(AsciiArt::pixel_to_ascii(255, 255, 255).ascii == '@' &&
+              AsciiArt::pixel_to_ascii(255, 255, 255).colorIndex == 231,
+          "pixel_to_ascii of white");
+    check(AsciiArt::pixel_to_ascii(255, 0, 0).ascii == 'x' && AsciiArt::pixel_to_ascii(255, 0, 0).colorIndex == 196,
+          "pixel_to_ascii of red");
+}
+
+AsciiArt::CellFrame filled_frame(const int w, const int h, const char glyph, const unsigned char color) {
+    AsciiArt::CellFrame frame(w, h);
+    std::fill(frame.glyphs.begin(), frame.glyphs.end(), glyph);
+    std::fill(frame.colors.begin(), frame.colors.end(), color);
+    return frame;
+}
+
+void set_cell(AsciiArt::CellFrame& frame, const int x, const int y, const char glyph, const unsigned char color) {
+    const std::size_t i = static_cast<std::size_t>(y) * frame.width + x;
+    frame.glyphs[i] = glyph;
+    frame.colors[i] = color;
+}
+
+// Escapes and newlines spelled out, for failure messages
+std::string printable(const std::string_view bytes) {
+    std::string out;
+    for (const char c : bytes) {
+        if (c == '\033') {
+            out += "\\e";
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+void check_bytes(const std::string_view name, const std::string_view actual, const std::string_view expected) {
+    check(actual == expected, std::string(name) + ": got \"" + printable(actual) + "\", expected \"" +
+                                  printable(expected) + "\"");
+}
+
+void test_encoder_golden() {
+    // Mono frames are redrawn from the top-left corner with the single escape they need
+    AsciiArt::CellFrame mono = filled_frame(3, 2, '.', AsciiArt::MONO_COLOR);
+    set_cell(mono, 1, 0, '@', AsciiArt::MONO_COLOR);
+    set_cell(mono, 2, 1, 'o', AsciiArt::MONO_COLOR);
+    const AsciiArt::Converter converter(3, 2);
+    AsciiArt::ByteBuffer out;
+    check(converter.encode(mono, out) == 1, "full redraw escape count");
+    check_bytes("full redraw", out.view(), "\033[H\033[38;5;231m.@.\n..o\n\033[0m");
+
+    // Colors only change through escapes, which carry over newlines
+    AsciiArt::CellFrame color = filled_frame(4, 2, '.', 16);
+    set_cell(color, 0, 0, '@', 196);
+    set_cell(color, 1, 0, '@', 196);
+    set_cell(color, 2, 0, '#', 21);
+    set_cell(color, 3, 1, 'o', 231);
+    out.clear();
+    check(AsciiArt::encode_ascii_frame(color, out) == 4, "color frame escape count");
+    check_bytes("color frame", out.view(),
+                "\033[38;5;196m@@\033[38;5;21m#\033[38;5;16m.\n...\033[38;5;231mo\n\033[0m");
+
+    // Only the changed cells are written, the cursor is parked below the frame afterwards
+    const AsciiArt::CellFrame shown = filled_frame(8, 3, '.', 16);
+    AsciiArt::CellFrame next = shown;
+    set_cell(next, 2, 0, '#', 16);
+    set_cell(next, 3, 0, '#', 16);
+    set_cell(next, 7, 2, '@', 196);
+    out.clear();
+    check(AsciiArt::encode_ascii_diff(shown, next, out) == 2, "diff escape count");
+    check_bytes("diff", out.view(), "\033[1;3H\033[38;5;16m##\033[3;8H\033[38;5;196m@\033[0m\n");
+
+    // Unchanged gaps no longer than a cursor move are rewritten, longer ones skipped
+    AsciiArt::CellFrame gaps = filled_frame(12, 3, '.', 16);
+    set_cell(gaps, 0, 1, 'x', 16);
+    set_cell(gaps, 2, 1, 'x', 16);
+    set_cell(gaps, 9, 1, 'x', 16);
+    out.clear();
+    AsciiArt::encode_ascii_diff(filled_frame(12, 3, '.', 16), gaps, out);
+    check_bytes("diff with gaps", out.view(), "\033[2H\033[38;5;16mx.x\033[6Cx\033[0m\n\n");
+
+    out.clear();
+    check(AsciiArt::encode_ascii_diff(shown, shown, out) == 0 && out.size() == 0, "diff of an unchanged frame");
+
+    // A diff larger than a redraw falls back to one
+    const AsciiArt::CellFrame changed = filled_frame(2, 2, '@', 231);
+    out.clear();
+    AsciiArt::encode_ascii_diff(filled_frame(2, 2, '.', 16), changed, out);
+    check_bytes("diff falling back to a redraw", out.view(), "\033[H\033[38;5;231m@@\n@@\n\033[0m");
+}
+
+// Just enough of a terminal for the encoders' output: CUP, CUF, SGR 0 and 38;5;n, and newlines, which the tty turns
+// into CR LF. Writing the last column leaves the cursor on it with a pending wrap, like xterm and the VT100.
+class Terminal {
+public:
+    Terminal(const int columns, const int rows)
+        : columns_(columns), rows_(rows), screen_(filled_frame(columns, rows, ' ', 0)) {}
+
+    // Returns false on a byte sequence the encoders should never emit
+    bool write(const std::string_view bytes) {
+        for (std::size_t i = 0; i < bytes.size(); ++i) {
+            const char c = bytes[i];
+            if (c == '\n') {
+                x_ = 0;
+                y_ = std::min(y_ + 1, rows_ - 1);
+                pendingWrap_ = false;
+            } else if (c == '\033') {
+                const std::size_t end = bytes.find_first_not_of("0123456789;", i + 2);
+                if (i + 1 >= bytes.size() || bytes[i + 1] != '[' || end == std::string_view::npos ||
+                    !control(bytes[end], bytes.substr(i + 2, end - i - 2))) {
+                    return false;
+                }
+                i = end;
+            } else {
+                if (pendingWrap_) {
+                    x_ = 0;
+                    y_ = std::min(y_ + 1, rows_ - 1);
+                    pendingWrap_ = false;
+                }
+                set_cell(screen_, x_, y_, c, static_cast<unsigned char>(color_));
+                if (x_ == columns_ - 1) {
+                    pendingWrap_ = true;
+                } else {
+                    ++x_;
+                }
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] AsciiArt::CellFrame top_left(const int w, const int h) const {
+        AsciiArt::CellFrame frame(w, h);
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                const std::size_t from = static_cast<std::size_t>(y) * columns_ + x;
+                set_cell(frame, x, y, screen_.glyphs[from], screen_.colors[from]);
+            }
+        }
+        return frame;
+    }
+
+    [[nodiscard]] bool cursor_at(const int x, const int y) const {
+        return x_ == x && y_ == y && !pendingWrap_;
+    }
+
+private:
+    bool control(const char command, const std::string_view params) {
+        std::vector<int> values;
+        std::size_t start = 0;
+        while (start <= params.size()) {
+            const std::size_t end = std::min(params.find(';', start), params.size());
+            values.push_back(end == start ? 0 : std::stoi(std::string(params.substr(start, end - start))));
+            start = end + 1;
+        }
+        const auto value = [&](const std::size_t i) {
+            return i < values.size() && values[i] > 0 ? values[i] : 1;
+        };
+
+        pendingWrap_ = false;
+        switch (command) {
+        case 'H':
+            y_ = std::min(value(0), rows_) - 1;
+            x_ = std::min(value(1), columns_) - 1;
+            return values.size() <= 2;
+        case 'C':
+            x_ = std::min(x_ + value(0), columns_ - 1);
+            return values.size() == 1;
+        case 'm':
+            if (values.size() == 1 && values[0] == 0) {
+                color_ = 0;
+                return true;
+            }
+            if (values.size() == 3 && values[0] == 38 && values[1] == 5 && values[2] < 256) {
+                color_ = values[2];
+                return true;
+            }
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    int columns_;
+    int rows_;
+    AsciiArt::CellFrame screen_;
+    int x_ = 0;
+    int y_ = 0;
+    bool pendingWrap_ = false;
+    int color_ = 0;
+};
+
+// Draws `bands` in order on a terminal showing `shown` and checks that the screen then shows `next` with the cursor
+// parked below it, once on a terminal exactly as wide as the frame and once on a wider one
+void check_rendering(const std::string_view name, const AsciiArt::CellFrame& shown, const AsciiArt::CellFrame& next,
+                     const std::span<const AsciiArt::ByteBuffer> bands) {
+    const AsciiArt::Converter converter(shown.width, shown.height);
+    AsciiArt::ByteBuffer redraw;
+    converter.encode(shown, redraw);
+
+    bool empty = true;
+    for (const AsciiArt::ByteBuffer& band : bands) {
+        empty = empty && band.size() == 0;
+    }
+
+    for (const int columns : {next.width, next.width + 5}) {
+        const std::string where = std::string(name) + " on " + std::to_string(columns) + " columns";
+        Terminal terminal(columns, next.height + 2);
+        check(terminal.write(redraw.view()) && terminal.top_left(shown.width, shown.height) == shown,
+              where + ": redraw of the shown frame");
+        bool valid = true;
+        for (const AsciiArt::ByteBuffer& band : bands) {
+            valid = terminal.write(band.view()) && valid;
+        }
+        check(valid, where + ": unexpected escape");
+        check(terminal.top_left(next.width, next.height) == next, where + ": screen differs from the next frame");
+        check(empty || terminal.cursor_at(0, next.height), where + ": cursor not parked below the frame");
+    }
+}
+
+void test_diff_rendering() {
+    constexpr std::string_view GLYPHS = ".o#";
+    constexpr std::array<unsigned char, 3> COLORS = {16, 196, 231};
+
+    std::mt19937 rng(3);
+    const auto random_cell = [&](AsciiArt::CellFrame& frame, const int x, const int y) {
+        set_cell(frame, x, y, GLYPHS[rng() % GLYPHS.size()], COLORS[rng() % COLORS.size()]);
+    };
+
+    for (const int w : {1, 2, 7, 16, 33, 80}) {
+        for (const int h : {1, 3, 6}) {
+            for (const unsigned changedPercent : {2U, 20U, 60U, 100U}) {
+                AsciiArt::CellFrame shown(w, h);
+                for (int y = 0; y < h; ++y) {
+                    for (int x = 0; x < w; ++x) {
+                        random_cell(shown, x, y);
+                    }
+                }
+                AsciiArt::CellFrame next = shown;
+                for (int y = 0; y < h; ++y) {
+                    for (int x = 0; x < w; ++x) {
+                        if (rng() % 100 < changedPercent) {
+                            random_cell(next, x, y);
+                        }
+                    }
+                }
+
+                const std::string name = std::to_string(w) + "x" + std::to_string(h) + " frame with " +
+                                         std::to_string(changedPercent) + "% changed";
+                AsciiArt::ByteBuffer diff;
+                AsciiArt::encode_ascii_diff(shown, next, diff);
+                check_rendering("diff of " + name, shown, next, std::span(&diff, 1));
+
+                const AsciiArt::Converter converter(w, h);
+                std::vector<AsciiArt::ByteBuffer> bands;
+                converter.encode_diff(shown, next, bands);
+                check_rendering("band diff of " + name, shown, next, bands);
+                converter.encode(next, bands);
+                check_rendering("band redraw of " + name, shown, next, bands);
+            }
+        }
+    }
+}
+
+// Packed RGB24 or planar YUV420P pixels and the frame pointing into them
+struct TestFrame {
+    std::vector<unsigned char> planes[3];
+    AVFrame frame{};
+};
+
+TestFrame random_frame(std::mt19937& rng, const AVPixelFormat format, const int w, const int h) {
+    TestFrame image;
+    image.frame.format = format;
+    image.frame.width = w;
+    image.frame.height = h;
+    const int planeCount = format == AV_PIX_FMT_RGB24 ? 1 : 3;
+    for (int plane = 0; plane < planeCount; ++plane) {
+        const int linesize = format == AV_PIX_FMT_RGB24 ? w * 3 : plane == 0 ? w : (w + 1) / 2;
+        const int rows = plane == 0 ? h : (h + 1) / 2;
+        image.planes[plane].resize(static_cast<std::size_t>(linesize) * rows);
+        for (unsigned char& byte : image.planes[plane]) {
+            byte = static_cast<unsigned char>(rng());
+        }
+        image.frame.data[plane] = image.planes[plane].data();
+        image.frame.linesize[plane] = linesize;
+    }
+    return image;
+}
+
+// Once the reused cells and buffers have grown, converting and encoding a frame allocates nothing, with or without
+// a pool, a lookup table or chroma
+void test_steady_state_allocations() {
+    constexpr int WIDTH = 200;
+    constexpr int HEIGHT = 60;
+    constexpr int WARMUP_FRAMES = 2;
+    constexpr int COUNTED_FRAMES = 8;
+
+    AsciiArt::ByteBuffer buffer;
+    buffer.reserve(64);
+    std::size_t before = allocations.load(std::memory_order_relaxed);
+    for (int i = 0; i < 1000; ++i) {
+        buffer.clear();
+        buffer.append(AsciiArt::CURSOR_HOME);
+        buffer.push_back('@');
+        buffer.resize(buffer.size() + 8);
+    }
+    check(allocations.load(std::memory_order_relaxed) == before, "ByteBuffer allocates once it is large enough");
+
+    std::mt19937 rng(4);
+    const std::array rgb = {random_frame(rng, AV_PIX_FMT_RGB24, WIDTH, HEIGHT),
+                            random_frame(rng, AV_PIX_FMT_RGB24, WIDTH, HEIGHT)};
+    const std::array yuv = {random_frame(rng, AV_PIX_FMT_YUV420P, 1280, 720),
+                            random_frame(rng, AV_PIX_FMT_YUV420P, 1280, 720)};
+    utils::WorkerPool pool(4);
+
+    for (utils::WorkerPool* const threads : {static_cast<utils::WorkerPool*>(nullptr), &pool}) {
+        for (const bool mono : {false, true}) {
+            AsciiArt::Converter converter(WIDTH, HEIGHT, mono ? 0 : 6, threads);
+            AsciiArt::CellFrame shown;
+            AsciiArt::CellFrame cells;
+            AsciiArt::ByteBuffer out;
+            std::vector<AsciiArt::ByteBuffer> bands;
+            bool converted = true;
+
+            const auto play_frame = [&](const int i) {
+                converted = converter.convert(rgb[i % 2].frame, cells) && converted;
+                converter.encode(cells, out);
+                converter.encode_diff(shown, cells, out);
+                converter.encode(cells, bands);
+                converter.encode_diff(shown, cells, bands);
+                std::swap(shown, cells);
+
+                converted = converter.convert_area(yuv[i % 2].frame, mono, cells) && converted;
+                out.clear();
+                AsciiArt::encode_ascii_frame(cells, out);
+                out.clear();
+                AsciiArt::encode_ascii_diff(shown, cells, out);
+                converter.encode_diff(shown, cells, bands);
+                std::swap(shown, cells);
+            };
+
+            for (int i = 0; i < WARMUP_FRAMES; ++i) {
+                play_frame(i);
+            }
+            before = allocations.load(std::memory_order_relaxed);
+            for (int i = 0; i < COUNTED_FRAMES; ++i) {
+                play_frame(i);
+            }
+            const std::size_t allocated = allocations.load(std::memory_order_relaxed) - before;
+
+            const std::string name = std::string(threads != nullptr ? "pooled" : "single-threaded") + " converter" +
+                                     (mono ? " in mono" : " with a lookup table");
+            check(converted, name + ": conversion failed");
+            check(allocated == 0, name + ": " + std::to_string(allocated) + " allocations in steady state");
+        }
+    }
+}
+
+} // namespace
+
+int main() {
+    if (vector_levels().empty()) {
+        std::cout << "No SSE4.1 on this CPU, only the scalar kernels run" << '\n';
+    }
+    test_rgb_row_kernels();
+    test_accumulate_row_kernels();
+    test_glyph_ramp();
+    test_encoder_golden();
+    test_diff_rendering();
+    test_steady_state_allocations();
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << '\n';
+        return 1;
+    }
+    std::cout << "All tests passed" << '\n';
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include "frame_timeline.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+// Tests of the presentation timeline of vid2ascii, run by `make test`
+
+namespace {
+
+using namespace std::chrono_literals;
+
+constexpr AVRational TIME_BASE = {1, 15360}; // What the MP4 muxer picks for 30 fps
+constexpr std::int64_t TICKS_PER_FRAME = 512;
+constexpr std::chrono::nanoseconds FRAME_INTERVAL = 33'333'333ns;
+constexpr std::chrono::nanoseconds MAX_GAP = 1s;
+
+int failures = 0;
+
+void check(const bool ok, const std::string_view what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << '\n';
+        ++failures;
+    }
+}
+
+// Within the nanosecond rounding of each gap
+bool near(const std::chrono::nanoseconds actual, const std::chrono::nanoseconds expected) {
+    return actual - expected < 1us && expected - actual < 1us;
+}
+
+// Timestamps at 30 fps advance by the frame interval
+void test_regular_frames() {
+    utils::FrameTimeline timeline(TIME_BASE, FRAME_INTERVAL, MAX_GAP);
+    bool exact = true;
+    for (std::int64_t frame = 0; frame < 300; ++frame) {
+        exact = near(timeline.next(frame * TICKS_PER_FRAME), std::chrono::nanoseconds(frame * 1'000'000'000 / 30)) &&
+                exact;
+    }
+    check(exact, "30 fps frames are presented 1 / 30 s apart");
+}
+
+// A timestamp jump is capped, a missing timestamp advances by the nominal interval
+void test_capped_gaps() {
+    utils::FrameTimeline timeline(TIME_BASE, FRAME_INTERVAL, MAX_GAP);
+    timeline.next(0);
+    check(timeline.next(TICKS_PER_FRAME * 30 * 5) == MAX_GAP, "a 5 s timestamp jump is capped to 1 s");
+    check(timeline.next(AV_NOPTS_VALUE) == MAX_GAP + FRAME_INTERVAL, "a missing timestamp advances by one frame");
+}
+
+// Keyframes only, with a GOP longer than the cap: the gaps the skipped packets leave keep their length, whether a
+// frame comes out of the decoder right away or, with frame threading, only after the next packets were read
+void test_skipped_packets() {
+    constexpr std::int64_t GOP = 90; // 3 s
+    constexpr std::int64_t KEYFRAMES = 10;
+
+    for (const bool delayed : {false, true}) {
+        utils::FrameTimeline timeline(TIME_BASE, FRAME_INTERVAL, MAX_GAP);
+        bool exact = true;
+        for (std::int64_t keyframe = 0; keyframe < KEYFRAMES; ++keyframe) {
+            if (delayed) {
+                for (std::int64_t packet = 1; packet < GOP; ++packet) {
+                    timeline.skip();
+                }
+            }
+            exact = near(timeline.next(keyframe * GOP * TICKS_PER_FRAME), keyframe * 3s) && exact;
+            if (!delayed) {
+                for (std::int64_t packet = 1; packet < GOP; ++packet) {
+                    timeline.skip();
+                }
+            }
+        }
+        check(exact, std::string("keyframes 3 s apart play at their timestamps") +
+                         (delayed ? " when decoded with a delay" : ""));
+    }
+}
+
+} // namespace
+
+int main() {
+    test_regular_frames();
+    test_capped_gaps();
+    test_skipped_packets();
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << '\n';
+        return 1;
+    }
+    std::cout << "All tests passed" << '\n';
+    return 0;
+}